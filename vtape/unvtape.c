@@ -21,30 +21,238 @@
  * SOFTWARE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* copy_file_range, splice */
+#endif
+
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+/* buffered tape image input */
+struct input
+{
+	int fd;			/* file descriptor */
+	int8_t *buf;		/* data read ahead of the caller */
+	size_t pos;		/* position in buf of the next byte to return */
+	size_t len;		/* number of bytes in buf */
+	size_t size;		/* size of buf */
+	off_t end;		/* size of the image (or the part a job reads), if it can be seeked (-1 if not) */
+	size_t limit;		/* if not 0, the most a refill should read (while only length words are read) */
+	int positional;		/* flag: read at offset 'at', leaving the file offset alone */
+	off_t at;		/* offset of the next read (positional input) */
+	struct readahead *ra;	/* reader thread (NULL for none) */
+};
+
+/* input buffers filled ahead of use by a separate thread, so reading overlaps parsing and writing */
+struct readahead
+{
+	int fd;			/* input file */
+	int seekable;		/* flag: read at 'next' with pread (else read in order) */
+	size_t size;		/* size of each buffer */
+	int depth;		/* number of buffers that may be read ahead */
+	int8_t **buf;		/* buffers, one more than depth */
+	size_t *len;		/* number of bytes read into each buffer (0 at end of input) */
+	off_t *offset;		/* image offset of each buffer */
+	int8_t *own;		/* the input's original buffer */
+	int head;		/* next buffer to be handed to the input */
+	int count;		/* number of buffers read but not yet handed over */
+	off_t next;		/* image offset of the next read */
+	int eof;		/* flag: end of input has been read */
+	int stop;		/* flag: the thread should exit */
+	unsigned gen;		/* changed when the input seeks, so reads in progress are discarded */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+};
+
+/* buffered output of a new tape image */
+struct output
+{
+	int fd;			/* file descriptor */
+	int8_t *buf;		/* data not yet written */
+	size_t len;		/* number of bytes in buf */
+	size_t size;		/* size of buf */
+};
+
+#define INPUT_SIZE 1048576
+#define OUTPUT_SIZE 1048576
+#define RECORD_CHUNK 1048576	/* records are copied in pieces of at most this size (at least the largest -n) */
+#define KERNEL_COPY_MIN 65536	/* records at least this size may be copied without reading them in */
+#define SEEK_MIN 512		/* after skipping a record at least this size, only the words around the next are read */
+
+/*
+ * An index lists where each tape file of an image begins and ends, and its
+ * record sizes, so later runs can skip or summarize files without reading
+ * their length words. It uses the format written by vtape -i (see vtape.c):
+ *
+ * header:  "VTIX", uint32 version (1), uint64 image size,
+ *          int64 image mtime seconds, uint32 image mtime nanoseconds,
+ *          uint32 number of tape files
+ * per tape file:
+ *          uint64 offset of first record, uint64 offset of the mark that ends
+ *          the file (or the image size, if the image ends first),
+ *          uint32 mark (0 = file mark, 0xFFFFFFFF = end of tape),
+ *          uint32 number of runs, then for each run of same-size records:
+ *          uint32 record size, uint32 number of records
+ *
+ * An index that doesn't match the image's size and modification time is
+ * rebuilt.
+ */
+struct index
+{
+	char *name;		/* index file name (NULL for no index) */
+	uint8_t *buf;		/* tape file entries */
+	size_t len;		/* number of bytes in buf */
+	size_t size;		/* size of buf */
+	size_t next;		/* position in buf of the next tape file's entry */
+	int open;		/* flag: an entry has been started but not ended */
+	size_t entry;		/* position in buf of the open entry */
+	uint32_t nfiles;	/* number of tape files */
+	uint32_t nruns;		/* number of runs in the open entry */
+	uint32_t run_size;	/* record size of the current run */
+	uint32_t run_count;	/* number of records in the current run */
+	int ended;		/* flag: end-of-tape mark has been indexed */
+};
+
+/* one tape file to be extracted in parallel with others */
+struct job
+{
+	size_t entry;		/* position of its index entry */
+	off_t start;		/* offset of its first record */
+	off_t end;		/* offset of the mark after its last record */
+	uint64_t records;	/* number of records */
+	int file;		/* tape file number */
+	int skipped;		/* flag: passed over by -s */
+	int done;		/* flag: extracted (or nothing to do) */
+};
+
+/* tape files shared out among extraction threads */
+struct pool
+{
+	int fd;			/* image */
+	struct job *jobs;	/* tape files, in tape order */
+	int njobs;		/* number of tape files */
+	int next;		/* next tape file to be claimed */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* signalled when a tape file is done */
+};
+
+/* an image being summarized or checked in its own process */
+struct scan
+{
+	const char *name;	/* image file name */
+	FILE *log;		/* status and error messages */
+	pid_t pid;		/* process reading the image */
+	int done;		/* flag: process has exited */
+	int status;		/* its exit status */
+};
+
+/* images being scanned at once, reported in command-line order */
+struct scans
+{
+	struct scan *scan;	/* images, in command-line order */
+	int n;			/* number of images started */
+	int reported;		/* number of images whose messages have been output */
+	int running;		/* number of processes still running */
+};
+
+#define INDEX_VERSION 1
+#define INDEX_HEADER 32		/* size of index header */
+#define INDEX_ENTRY 24		/* size of tape file entry, not counting runs */
+
 void usage(const char *command, int status);
-void extract_file(int fd);
+int check_template(const char *name);
+void read_image(const char *name);
+void wait_scan(void);
+void report_scans(int all);
+void extract_image(const char *name);
+void extract_file(struct input *in, struct index *ix);
+int verify_file(struct input *in, const char *name);
+void reblock_file(struct input *in);
+void put_record(struct output *out, int8_t *buf, size_t nbytes);
+int in_list(const char *list, int num);
+int list_last(const char *list);
+void slice_file(struct input *in, struct index *ix);
+void slice_end(struct input *in, int file, off_t start, off_t nbytes, int8_t *buf);
+void copy_range(struct input *in, struct output *out, off_t start, off_t end, int8_t *buf);
+void extract_parallel(struct input *in, struct index *ix);
+void *extract_thread(void *arg);
+void extract_job(struct input *in, struct job *jb, int8_t *buf);
+void copy_record(struct input *in, int out, int8_t *buf, size_t sz);
+int can_copy(struct input *in, int out);
+size_t copy_kernel(struct input *in, int out, size_t nbytes, int kind);
+void report_job(struct index *ix, struct job *jb, off_t image_end);
+void output_name(char *name, size_t size, int file);
+void find_last(struct input *in, int num);
+uint32_t word_at(struct input *in, off_t offset, off_t *base);
+void skip_indexed(struct input *in, struct index *ix, int *n, size_t *last_sz);
+int load_index(struct index *ix, struct input *in);
+int build_index(struct index *ix, struct input *in);
+void write_index(struct index *ix, struct input *in);
+void index_record(struct index *ix, off_t offset, uint32_t size);
+void index_mark(struct index *ix, off_t offset, uint32_t mark);
+void index_start(struct index *ix, off_t offset);
+void index_run(struct index *ix);
+void index_int(struct index *ix, size_t pos, uint64_t value, int nbytes);
+void set_int(uint8_t *buf, uint64_t value, int nbytes);
+uint64_t get_int(const uint8_t *buf, int nbytes);
+void init_input(struct input *in, int fd);
+void free_input(struct input *in);
+size_t read_input(struct input *in, void *buf, size_t nbytes);
+size_t skip_input(struct input *in, size_t nbytes);
+size_t fill_input(struct input *in);
+off_t tell_input(struct input *in);
+void seek_input(struct input *in, off_t offset);
+void start_reader(struct input *in, int depth);
+void *reader_thread(void *arg);
+size_t next_buffer(struct input *in);
+void stop_reader(struct input *in);
 size_t read_buffer(int fd, void *buf, size_t nbytes);
 void write_buffer(int fd, const void *buf, size_t nbytes);
 int get_int32(int8_t *buf);
+void init_output(struct output *out, int fd);
+void put_bytes(struct output *out, const void *buf, size_t nbytes);
+void put_int32(struct output *out, uint32_t value);
+void flush_output(struct output *out);
 
 size_t RECORD_SIZE = 0;		/* default: variable-length records */
 int FILE_SKIP = 0;		/* default: extract first file */
 int FILE_PAD = 0;		/* default: do not pad short records */
 int VERBOSE = 0;		/* default: do not write status to standard error */
 int SUMMARY = 0;		/* default: do not summarize tape content */
+char *EXTRACT_NAME = NULL;	/* default: extract one file to standard output */
+char *INDEX_NAME = NULL;	/* default: no index for the next image */
+int AUTO_INDEX = 0;		/* default: do not keep an index beside each image */
+int FILE_LAST = 0;		/* default: count files from the beginning of the tape */
+int JOBS = 1;			/* default: extract one file at a time */
+int READ_AHEAD = 0;		/* default: do not read ahead of parsing */
+int VERIFY = 0;			/* default: extract, rather than only check record framing */
+int BAD_IMAGES = 0;		/* number of images that failed -V (or with -j, failed to be read) */
+size_t REBLOCK_SIZE = 0;	/* default: extract, rather than write a reblocked image */
+char *REBLOCK_FILES = NULL;	/* default: reblock every file */
+char *SLICE_FILES = NULL;	/* default: extract, rather than copy whole tape files to a new image */
+int KERNEL_COPY = 1;		/* cleared if the kernel refuses to copy between image and output */
+
+struct input STDIN_INPUT = { .fd = -1 };	/* kept between uses, as it can't be rewound */
+struct scans SCANS = { NULL };		/* images being summarized or checked with -j */
+struct output SLICE_OUTPUT = { .fd = -1 };	/* new image made by -c, kept open until every image is read */
 
 int main(int argc, char **argv)
 {
 	int fflag = 0;	/* flag: command-line specified a file */
 	char *cmd = *argv;
 
+	(void)argc;	/* the command line ends with a NULL */
 	while (*(++argv))
 	{
 		char *arg = *argv;
@@ -53,8 +261,13 @@ int main(int argc, char **argv)
 			if (arg[1] == 0)
 			{
 				/* "-" by itself reads from stdin */
+				report_scans(1);
 				if (VERBOSE) fprintf(stderr, "standard input\n");
-				extract_file(STDIN_FILENO);
+				if (STDIN_INPUT.fd == -1) init_input(&STDIN_INPUT, STDIN_FILENO);
+				if (VERIFY) verify_file(&STDIN_INPUT, "standard input");
+				else if (REBLOCK_SIZE) reblock_file(&STDIN_INPUT);
+				else if (SLICE_FILES != NULL) slice_file(&STDIN_INPUT, NULL);
+				else extract_file(&STDIN_INPUT, NULL);
 				fflag = 1;
 				continue;
 			}
@@ -72,6 +285,11 @@ int main(int argc, char **argv)
 					VERBOSE = 1;
 					continue;
 				}
+				if (*arg == 'V') /* -V */
+				{
+					VERIFY = 1;
+					continue;
+				}
 				if (*arg == 'v') /* -v */
 				{
 					VERBOSE = 1;
@@ -91,6 +309,15 @@ int main(int argc, char **argv)
 					FILE_SKIP = n;
 					break;
 				}
+				if (*arg == 'e') /* -e num */
+				{
+					if (*(++arg) == 0) arg = *(++argv);
+					if (arg == NULL) usage(cmd, 1);
+					int n = strtonum(arg, 1, 1048576, NULL);
+					if (n == 0) err(1, "error processing -e argument");
+					FILE_LAST = n;
+					break;
+				}
 				if (*arg == 'n') /* -n recordsize */
 				{
 					if (*(++arg) == 0) arg = *(++argv);
@@ -100,16 +327,74 @@ int main(int argc, char **argv)
 					RECORD_SIZE = n;
 					break;
 				}
+				if (*arg == 'R') /* -R recordsize */
+				{
+					if (*(++arg) == 0) arg = *(++argv);
+					if (arg == NULL) usage(cmd, 1);
+					int n = strtonum(arg, 1, 1048576, NULL);
+					if (n == 0) err(1, "error processing -R argument");
+					REBLOCK_SIZE = n;
+					break;
+				}
+				if (*arg == 'F') /* -F files */
+				{
+					if (*(++arg) == 0) arg = *(++argv);
+					if (arg == NULL) usage(cmd, 1);
+					if (in_list(arg, 0) == -1) errx(1, "-F list must be tape file numbers or ranges, such as 1,3-5");
+					REBLOCK_FILES = arg;
+					break;
+				}
+				if (*arg == 'c') /* -c files */
+				{
+					if (*(++arg) == 0) arg = *(++argv);
+					if (arg == NULL) usage(cmd, 1);
+					if (in_list(arg, 0) == -1) errx(1, "-c list must be tape file numbers or ranges, such as 1,3-5");
+					SLICE_FILES = arg;
+					break;
+				}
+				if (*arg == 'x') /* -x template */
+				{
+					if (*(++arg) == 0) arg = *(++argv);
+					if (arg == NULL) usage(cmd, 1);
+					if (!check_template(arg)) errx(1, "-x template must contain one integer conversion, such as %%03d");
+					EXTRACT_NAME = arg;
+					break;
+				}
+				if (*arg == 'r') /* -r depth */
+				{
+					if (*(++arg) == 0) arg = *(++argv);
+					if (arg == NULL) usage(cmd, 1);
+					int n = strtonum(arg, 1, 1024, NULL);
+					if (n == 0) err(1, "error processing -r argument");
+					READ_AHEAD = n;
+					break;
+				}
+				if (*arg == 'j') /* -j jobs */
+				{
+					if (*(++arg) == 0) arg = *(++argv);
+					if (arg == NULL) usage(cmd, 1);
+					int n = strtonum(arg, 1, 1024, NULL);
+					if (n == 0) err(1, "error processing -j argument");
+					JOBS = n;
+					break;
+				}
+				if (*arg == 'i') /* -i indexfile */
+				{
+					if (*(++arg) == 0) arg = *(++argv);
+					if (arg == NULL) usage(cmd, 1);
+					INDEX_NAME = arg;
+					break;
+				}
+				if (*arg == 'I') /* -I */
+				{
+					AUTO_INDEX = 1;
+					continue;
+				}
 				if (*arg == 'f') /* -f filename */
 				{
 					if (*(++arg) == 0) arg = *(++argv);
 					if (arg == NULL) usage(cmd, 1);
-					if (VERBOSE) fprintf(stderr, "%s\n", arg);
-					int n = open(arg, O_RDONLY);
-					if (n == -1) err(1, "error opening file %s", arg);
-					extract_file(n);
-					n = close(n);
-					if (n == -1) err(1, "error closing file %s", arg);
+					read_image(arg);
 					fflag = 1;
 					break;
 				}
@@ -119,23 +404,31 @@ int main(int argc, char **argv)
 		}
 
 		/* assume non-option arguments are file names */
-		if (VERBOSE) fprintf(stderr, "%s\n", arg);
-		int fd = open(arg, O_RDONLY);
-		if (fd == -1) err(1, "error opening file %s", arg);
-		extract_file(fd);
-		fd = close(fd);
-		if (fd == -1) err(1, "error closing file %s", arg);
+		read_image(arg);
 		fflag = 1;
 	}
+	report_scans(1);
 
 	if (fflag == 0)
 	{
 		/* if command-line didn't specify any files, assume stdin */
 		if (VERBOSE) fprintf(stderr, "standard input\n");
-		extract_file(STDIN_FILENO);
+		init_input(&STDIN_INPUT, STDIN_FILENO);
+		if (VERIFY) verify_file(&STDIN_INPUT, "standard input");
+		else if (REBLOCK_SIZE) reblock_file(&STDIN_INPUT);
+		else if (SLICE_FILES != NULL) slice_file(&STDIN_INPUT, NULL);
+		else extract_file(&STDIN_INPUT, NULL);
 	}
 
-	return 0;
+	/* the tape made from the files copied by -c ends here */
+	if (SLICE_OUTPUT.fd != -1)
+	{
+		if (VERBOSE) fprintf(stderr, " (tape end mark)\n");
+		put_int32(&SLICE_OUTPUT, 0xFFFFFFFF);
+		flush_output(&SLICE_OUTPUT);
+	}
+
+	return (BAD_IMAGES) ? 1 : 0;
 }
 
 /* output usage message */
@@ -146,27 +439,206 @@ void usage(const char *command, int status)
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, "  -h or -?      - display this message\n");
 	fprintf(stderr, "  -S            - summarize tape content without extracting\n");
+	fprintf(stderr, "  -V            - check the framing of every record without extracting\n");
 	fprintf(stderr, "  -s num        - skip past 'num' file marks in input (default 0)\n");
+	fprintf(stderr, "  -e num        - start 'num' files from the end of the tape (1 = last file)\n");
 	fprintf(stderr, "  -n recordsize - set a fixed tape record size (default variable)\n");
 	fprintf(stderr, "  -f filename   - extract from the named file (-f may be omitted)\n");
 	fprintf(stderr, "  -p            - pad short records in the extracted file\n");
+	fprintf(stderr, "  -x template   - extract every file to its own output, named by 'template'\n");
+	fprintf(stderr, "                  with its tape file number (e.g. file%%03d)\n");
+	fprintf(stderr, "  -R recordsize - write a new image to standard output, with the data of each file\n");
+	fprintf(stderr, "                  regrouped into 'recordsize'-byte records\n");
+	fprintf(stderr, "  -F files      - with -R, regroup only the listed files (e.g. 1,3-5), copying the rest\n");
+	fprintf(stderr, "  -c files      - copy the listed files (e.g. 1,3-5) of the images that follow, as they\n");
+	fprintf(stderr, "                  are, to a new image on standard output, ending it with a tape end mark\n");
+	fprintf(stderr, "  -r depth      - read up to 'depth' MB of the image ahead in a separate thread\n");
+	fprintf(stderr, "  -j jobs       - with -x, extract up to 'jobs' files at once (default 1);\n");
+	fprintf(stderr, "                  with -S or -V, read up to 'jobs' images at once\n");
+	fprintf(stderr, "  -i indexfile  - use (or create) 'indexfile' as an index of the next image\n");
+	fprintf(stderr, "  -I            - use (or create) an index of each image, named image.vtix\n");
 	fprintf(stderr, "  -v            - display status information\n");
 	fprintf(stderr, "  -             - extract from standard input (default if no files given)\n");
 	fprintf(stderr, "  --            - don't extract from standard input (suppress '-' default)\n");
 	exit(status);
 }
 
-/* extract file from SIMH virtual tape image */
-void extract_file(int fd)
+/* extract from a named image, or with -S or -V and -j, start reading it in a separate process */
+void read_image(const char *name)
+{
+	/* only images that produce nothing but messages can be read out of order */
+	int quiet = (VERIFY) || ((SUMMARY) && (!REBLOCK_SIZE) && (SLICE_FILES == NULL));
+	if ((!quiet) || (JOBS == 1))
+	{
+		extract_image(name);
+		return;
+	}
+
+	/* messages are held until earlier images are reported, so don't get too far ahead */
+	while ((SCANS.running == JOBS) || (SCANS.n - SCANS.reported >= 4 * JOBS))
+	{
+		wait_scan();
+		report_scans(0);
+	}
+
+	if ((SCANS.scan = reallocarray(SCANS.scan, SCANS.n + 1, sizeof(struct scan))) == NULL) err(1, "unable to start reading %s", name);
+	struct scan *sc = &SCANS.scan[SCANS.n];
+	sc->name = name;
+	sc->done = 0;
+	if ((sc->log = tmpfile()) == NULL) err(1, "unable to create log for %s", name);
+	fflush(stdout);
+	fflush(stderr);
+	if ((sc->pid = fork()) == -1) err(1, "unable to start reading %s", name);
+	if (sc->pid == 0)
+	{
+		if (dup2(fileno(sc->log), STDERR_FILENO) == -1) _exit(1);
+		extract_image(name);
+		exit((BAD_IMAGES) ? 1 : 0);
+	}
+
+	/* the child has used up any -i and -s given for this image */
+	INDEX_NAME = NULL;
+	FILE_SKIP = 0;
+	SCANS.n++;
+	SCANS.running++;
+}
+
+/* wait for a process reading an image to exit */
+void wait_scan(void)
+{
+	int status, i;
+
+	pid_t pid = wait(&status);
+	if (pid == -1) err(1, NULL);
+	for (i = 0; (i < SCANS.n) && (SCANS.scan[i].pid != pid); i++);
+	if (i == SCANS.n) return;
+	SCANS.scan[i].done = 1;
+	SCANS.scan[i].status = status;
+	SCANS.running--;
+}
+
+/* output the messages of images that are done, stopping at the first one that isn't (unless waiting for all) */
+void report_scans(int all)
+{
+	while (SCANS.reported < SCANS.n)
+	{
+		struct scan *sc = &SCANS.scan[SCANS.reported];
+		if (!sc->done)
+		{
+			if (!all) break;
+			wait_scan();
+			continue;
+		}
+		int c;
+		rewind(sc->log);
+		while ((c = getc(sc->log)) != EOF) putc(c, stderr);
+		fclose(sc->log);
+		if (!WIFEXITED(sc->status)) warnx("error reading image %s", sc->name);
+		if (!WIFEXITED(sc->status) || (WEXITSTATUS(sc->status) != 0)) BAD_IMAGES++;
+		SCANS.reported++;
+	}
+}
+
+/* extract from a named SIMH virtual tape image, using an index if asked to */
+void extract_image(const char *name)
+{
+	struct input in;
+	struct index ix, *p = NULL;
+
+	if (VERBOSE) fprintf(stderr, "%s\n", name);
+	int fd = open(name, O_RDONLY);
+	if (fd == -1) err(1, "error opening file %s", name);
+	init_input(&in, fd);
+
+	if (VERIFY)
+	{
+		/* the whole image is read, so an index is no help */
+		verify_file(&in, name);
+		free_input(&in);
+		if (close(fd) == -1) err(1, "error closing file %s", name);
+		return;
+	}
+	if (REBLOCK_SIZE)
+	{
+		reblock_file(&in);
+		free_input(&in);
+		if (close(fd) == -1) err(1, "error closing file %s", name);
+		return;
+	}
+
+	memset(&ix, 0, sizeof(ix));
+	char auto_name[PATH_MAX];
+	if ((INDEX_NAME == NULL) && (AUTO_INDEX))
+	{
+		if (snprintf(auto_name, sizeof(auto_name), "%s.vtix", name) >= (int)sizeof(auto_name)) errx(1, "index file name too long");
+		ix.name = auto_name;
+	}
+	else
+	{
+		ix.name = INDEX_NAME;
+	}
+	INDEX_NAME = NULL;
+	if (ix.name != NULL)
+	{
+		if (in.end == -1)
+		{
+			warnx("%s is not a regular file, so it can't be indexed", name);
+		}
+		else if (load_index(&ix, &in))
+		{
+			p = &ix;
+		}
+		else if (build_index(&ix, &in))
+		{
+			write_index(&ix, &in);
+			p = &ix;
+		}
+	}
+
+	/* whole tape files are copied from where the index (if any) says they are */
+	if (SLICE_FILES != NULL)
+	{
+		slice_file(&in, p);
+	}
+	/* files can be extracted in parallel once it's known where they are */
+	else
+	if ((EXTRACT_NAME != NULL) && (JOBS > 1) && (!SUMMARY) && (!FILE_LAST) && (in.end != -1))
+	{
+		if ((p == NULL) && (ix.name == NULL) && (build_index(&ix, &in))) p = &ix;
+		if (p != NULL) extract_parallel(&in, p);
+		else extract_file(&in, p);
+	}
+	else
+	{
+		extract_file(&in, p);
+	}
+	free(ix.buf);
+	free_input(&in);
+	if (close(fd) == -1) err(1, "error closing file %s", name);
+}
+
+/* extract file (or with -x, every file) from SIMH virtual tape image */
+void extract_file(struct input *in, struct index *ix)
 {
 	int8_t *buf, hdr[4];
 	size_t ct, sz, last_sz;
+	int out = (EXTRACT_NAME == NULL) ? STDOUT_FILENO : -1;
+	int file = 0;	/* tape file number */
 
-	size_t buf_size = (RECORD_SIZE == 0) ? 65536 : RECORD_SIZE;
-	if ((buf = malloc(buf_size)) == NULL) err(1, "unable to initialize buffer");
+	if ((buf = malloc(RECORD_CHUNK)) == NULL) err(1, "unable to initialize buffer");
 
 	int n = 0;
-	while ((ct = read_buffer(fd, &hdr, 4)) > 0)
+	last_sz = 0;
+	if ((READ_AHEAD) && (in->ra == NULL)) start_reader(in, READ_AHEAD);
+	if (((FILE_SKIP) || (SUMMARY)) && (in->end != -1)) in->limit = 8;	/* length words come first; see skip_input() */
+	if (FILE_LAST)
+	{
+		/* the index counts files from the beginning, which is no help here */
+		find_last(in, FILE_LAST);
+		ix = NULL;
+	}
+	if ((ix != NULL) && ((FILE_SKIP) || (SUMMARY))) skip_indexed(in, ix, &n, &last_sz);
+	while ((ct = read_input(in, &hdr, 4)) > 0)
 	{
 		if (((sz = get_int32(hdr)) == 0) || ((sz & 0xF0000000) == 0xF0000000))
 		{
@@ -212,9 +684,23 @@ void extract_file(int fd)
 				if (FILE_SKIP > 0)
 				{
 					FILE_SKIP--;
+					file++;
+					if ((ix != NULL) && ((FILE_SKIP) || (SUMMARY))) skip_indexed(in, ix, &n, &last_sz);
+					continue;
+				}
+				if (SUMMARY)
+				{
+					if (ix != NULL) skip_indexed(in, ix, &n, &last_sz);
+					continue;
+				}
+				if (EXTRACT_NAME != NULL)
+				{
+					/* go on to the next file */
+					if ((out != -1) && (close(out) == -1)) err(1, "error closing output file");
+					out = -1;
+					file++;
 					continue;
 				}
-				if (SUMMARY) continue;
 			}
 			break;
 		}
@@ -232,30 +718,20 @@ void extract_file(int fd)
 			n = 0;
 		}
 
-		if (sz > buf_size)
+		if ((!FILE_SKIP) && (!SUMMARY) && (out == -1))
 		{
-			if ((buf_size = sz) & 1) buf_size++;
-			if ((buf = realloc(buf, buf_size)) == NULL) err(1, "unable to resize buffer");
+			/* output files are only created for tape files with records in them */
+			char name[PATH_MAX];
+			output_name(name, sizeof(name), file);
+			if (VERBOSE) fprintf(stderr, "%s:", name);
+			if ((out = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) err(1, "error opening output file %s", name);
 		}
-		if ((ct = sz) & 1) ct++;
-		ct = read_buffer(fd, buf, ct);
-		if (ct == 0) err(1, "unexpected end of tape reading %zu-byte record", sz);
-		ct = read_buffer(fd, &hdr, 4);
-		if (ct == 0) err(1, "unexpected end of tape reading record trailer");
+		copy_record(in, ((FILE_SKIP) || (SUMMARY)) ? -1 : out, buf, sz);
 		n++;
 		last_sz = sz;
-
-		if ((!FILE_SKIP) && (!SUMMARY))
-		{
-			if (RECORD_SIZE != 0)
-			{
-				if (sz > RECORD_SIZE) sz = RECORD_SIZE;
-				if (FILE_PAD) while(sz < RECORD_SIZE) buf[sz++] = 0;
-			}
-			write_buffer(STDOUT_FILENO, buf, sz);
-		}
 	}
 	free(buf);
+	if ((EXTRACT_NAME != NULL) && (out != -1) && (close(out) == -1)) err(1, "error closing output file");
 
 	if (VERBOSE)
 	{
@@ -274,30 +750,1379 @@ void extract_file(int fd)
 	}
 }
 
-/* read a full buffer (even from a pipe) */
-size_t read_buffer(int fd, void *buf, size_t nbytes)
+/* check every length word, pad byte and marker in an image, reporting the first fault (1 = image is good) */
+int verify_file(struct input *in, const char *name)
 {
-	size_t p = 0;
-	while (p < nbytes)
+	int8_t hdr[4], pad;
+	char fault[80];
+	off_t pos = 0;		/* offset of the word being checked, from where reading started */
+	off_t at = 0;		/* offset of the fault */
+	long long nrecords = 0;
+	long long nbad = 0;	/* bad-data records (valid framing, so not faults) */
+	long long nprivate = 0;	/* private records and markers (likewise) */
+	int nfiles = 0;
+	size_t ct;
+
+	if ((READ_AHEAD) && (in->ra == NULL)) start_reader(in, READ_AHEAD);
+	if (in->end != -1) in->limit = 8;	/* only the framing is read, unless records are too small to seek past */
+	fault[0] = 0;
+	while ((ct = read_input(in, &hdr, 4)) > 0)
 	{
-		ssize_t ct = read(fd, buf + p, nbytes - p);
-		if (ct == -1) err(1, NULL);
-		if (ct == 0) break;
-		p += ct;
+		at = pos;
+		if (ct < 4)
+		{
+			snprintf(fault, sizeof(fault), "image ends inside a length word");
+			break;
+		}
+		uint32_t sz = get_int32(hdr);
+		pos += 4;
+		if (sz == 0)
+		{
+			nfiles++;
+			continue;
+		}
+		if (sz == 0xFFFFFFFF)
+		{
+			/* anything past the end-of-tape mark would never be read */
+			if ((in->end != -1) && (pos != in->end)) snprintf(fault, sizeof(fault), "tape end mark is %lld bytes before the end of the image", (long long)(in->end - pos));
+			break;
+		}
+		if (sz == 0xFFFFFFFE) continue;
+		if (sz == 0xFFFEFFFF)
+		{
+			/* a half gap is only 2 bytes long; the next length word starts in its second half */
+			if (in->pos >= 2) in->pos -= 2;
+			else if (in->end != -1) seek_input(in, tell_input(in) - 2);
+			else
+			{
+				snprintf(fault, sizeof(fault), "half gap can't be followed on standard input");
+				break;
+			}
+			pos -= 2;
+			continue;
+		}
+
+		/*
+		 * the top 4 bits of a length word give its class: good data (0), private
+		 * data (1-6), a private marker (7), bad data (8), reserved data (9-E) or
+		 * a marker (F).  private and bad data are framed like good data, so
+		 * they are noted rather than treated as faults; only reserved classes are.
+		 */
+		switch (sz >> 28)
+		{
+		case 0:
+			break;
+		case 7:
+			nprivate++;
+			continue;
+		case 8:
+			nbad++;
+			break;
+		case 0xF:
+			snprintf(fault, sizeof(fault), "reserved marker 0x%08X", sz);
+			break;
+		default:
+			if (sz >> 28 < 7) nprivate++;
+			else snprintf(fault, sizeof(fault), "reserved data record (class %u) of %u bytes", sz >> 28, sz & 0x0FFFFFFF);
+			break;
+		}
+		if (fault[0] != 0) break;
+
+		/* the data is skipped (seeked past, where possible); only the framing around it is read */
+		uint32_t n = sz & 0x0FFFFFFF;	/* data length; the trailer repeats the whole word */
+		off_t len = (off_t)n + (n & 1);
+		if ((in->end != -1) && (pos + len + 4 > in->end))
+		{
+			snprintf(fault, sizeof(fault), "%u-byte record runs past the end of the image", n);
+			break;
+		}
+		if (skip_input(in, n) < n)
+		{
+			snprintf(fault, sizeof(fault), "image ends inside a %u-byte record", n);
+			break;
+		}
+		if (n & 1)
+		{
+			at = pos + n;
+			if (read_input(in, &pad, 1) < 1)
+			{
+				snprintf(fault, sizeof(fault), "image ends before the pad byte of a %u-byte record", n);
+				break;
+			}
+			if (pad != 0)
+			{
+				snprintf(fault, sizeof(fault), "pad byte of a %u-byte record is 0x%02X, not 0", n, pad & 255);
+				break;
+			}
+		}
+		at = pos + len;
+		if (read_input(in, &hdr, 4) < 4)
+		{
+			snprintf(fault, sizeof(fault), "image ends before the trailer of a %u-byte record", n);
+			break;
+		}
+		uint32_t tr = get_int32(hdr);
+		if (tr != sz)
+		{
+			if (sz == n) snprintf(fault, sizeof(fault), "record trailer %u doesn't match its length %u", tr, sz);
+			else snprintf(fault, sizeof(fault), "record trailer 0x%08X doesn't match its length word 0x%08X", tr, sz);
+			break;
+		}
+		pos += len + 4;
+		nrecords++;
 	}
-	return p;
+
+	if (fault[0] != 0)
+	{
+		warnx("%s: offset %lld: %s", name, (long long)at, fault);
+		BAD_IMAGES++;
+		return 0;
+	}
+	if ((nbad != 0) || (nprivate != 0)) warnx("%s: note: %lld bad-data record%s, %lld private record%s or marker%s (not faults)", name, nbad, (nbad == 1) ? "" : "s", nprivate, (nprivate == 1) ? "" : "s", (nprivate == 1) ? "" : "s");
+	if (VERBOSE) fprintf(stderr, " (%d file mark%s, %lld record%s, ok)\n", nfiles, (nfiles == 1) ? "" : "s", nrecords, (nrecords == 1) ? "" : "s");
+	return 1;
 }
 
-/* write a buffer */
-void write_buffer(int fd, const void *buf, size_t nbytes)
+/* copy an image to standard output, regrouping the data of each selected file into REBLOCK_SIZE-byte records */
+void reblock_file(struct input *in)
 {
-	size_t p = 0;
-	while (p < nbytes)
+	struct output out;
+	int8_t hdr[4], *buf, *rec;
+	size_t ct, sz;
+	size_t fill = 0;	/* bytes in the record being built */
+	off_t nbytes = 0;	/* data bytes in the current file */
+	long long n = 0;	/* records in the current file (written, if it is being reblocked) */
+	int file = 0;		/* tape file number */
+
+	if ((buf = malloc(RECORD_CHUNK)) == NULL) err(1, "unable to initialize buffer");
+	if ((rec = malloc(REBLOCK_SIZE)) == NULL) err(1, "unable to initialize buffer");
+	init_output(&out, STDOUT_FILENO);
+	if ((READ_AHEAD) && (in->ra == NULL)) start_reader(in, READ_AHEAD);
+
+	int sel = (REBLOCK_FILES == NULL) || (in_list(REBLOCK_FILES, file));
+	while ((ct = read_input(in, &hdr, 4)) > 0)
 	{
-		ssize_t ct = write(fd, buf + p, nbytes - p);
-		if (ct == -1) err(1, NULL);
-		p += ct;
+		if (((sz = (uint32_t)get_int32(hdr)) == 0) || ((sz & 0xF0000000) == 0xF0000000))
+		{
+			/* a marker ends the record being built, and is copied as it is */
+			if (fill != 0)
+			{
+				put_record(&out, rec, fill);
+				fill = 0;
+				n++;
+			}
+			if (VERBOSE)
+			{
+				if ((sel) && (nbytes != 0)) fprintf(stderr, " (%lld byte%s in %lld %zu-byte record%s)", (long long)nbytes, (nbytes == 1) ? "" : "s", n, REBLOCK_SIZE, (n == 1) ? "" : "s");
+				else if (n != 0) fprintf(stderr, " (%lld record%s copied)", n, (n == 1) ? "" : "s");
+				if (sz == 0) fprintf(stderr, " (file mark)\n");
+				else if (sz == 0xFFFFFFFF) fprintf(stderr, " (tape end mark)\n");
+				else if (sz == 0xFFFFFFFE) fprintf(stderr, " (erase gap)");
+				else fprintf(stderr, " (tape marker 0x%X)", (unsigned)sz);
+			}
+			nbytes = n = 0;
+			put_bytes(&out, hdr, 4);
+			if (sz == 0xFFFFFFFF) break;
+			if (sz == 0)
+			{
+				file++;
+				sel = (REBLOCK_FILES == NULL) || (in_list(REBLOCK_FILES, file));
+			}
+			continue;
+		}
+
+		size_t len = sz + (sz & 1);
+		size_t p = 0;
+		if (sel)
+		{
+			/* record boundaries are ignored; the data just goes into the next new records */
+			while (p < sz)
+			{
+				size_t k = (sz - p < REBLOCK_SIZE - fill) ? sz - p : REBLOCK_SIZE - fill;
+				if (read_input(in, rec + fill, k) < k) err(1, "unexpected end of tape reading %zu-byte record", sz);
+				fill += k;
+				p += k;
+				if (fill == REBLOCK_SIZE)
+				{
+					put_record(&out, rec, fill);
+					fill = 0;
+					n++;
+				}
+			}
+			if ((sz & 1) && (skip_input(in, 1) == 0)) err(1, "unexpected end of tape reading %zu-byte record", sz);
+			nbytes += sz;
+		}
+		else
+		{
+			/* a record of a file that isn't being reblocked is copied a piece at a time */
+			put_bytes(&out, hdr, 4);
+			while (p < len)
+			{
+				size_t k = (len - p > RECORD_CHUNK) ? RECORD_CHUNK : len - p;
+				if (read_input(in, buf, k) < k) err(1, "unexpected end of tape reading %zu-byte record", sz);
+				put_bytes(&out, buf, k);
+				p += k;
+			}
+			n++;
+		}
+		if (read_input(in, &hdr, 4) < 4) err(1, "unexpected end of tape reading record trailer");
+		if (!sel) put_bytes(&out, hdr, 4);
+	}
+
+	/* an image may end without a file mark */
+	if (fill != 0)
+	{
+		put_record(&out, rec, fill);
+		n++;
+	}
+	if ((VERBOSE) && (n != 0))
+	{
+		if ((sel) && (nbytes != 0)) fprintf(stderr, " (%lld byte%s in %lld %zu-byte record%s)\n", (long long)nbytes, (nbytes == 1) ? "" : "s", n, REBLOCK_SIZE, (n == 1) ? "" : "s");
+		else fprintf(stderr, " (%lld record%s copied)\n", n, (n == 1) ? "" : "s");
+	}
+	flush_output(&out);
+	free(out.buf);
+	free(rec);
+	free(buf);
+}
+
+/* write one record of a new image, padded to full size with -p */
+void put_record(struct output *out, int8_t *buf, size_t nbytes)
+{
+	if ((FILE_PAD) && (nbytes < REBLOCK_SIZE))
+	{
+		memset(buf + nbytes, 0, REBLOCK_SIZE - nbytes);
+		nbytes = REBLOCK_SIZE;
+	}
+	put_int32(out, nbytes);
+	put_bytes(out, buf, nbytes);
+	if (nbytes & 1) put_bytes(out, "", 1);
+	put_int32(out, nbytes);
+}
+
+/* check whether a number is in a list such as 1,3-5 (-1 = list isn't valid) */
+int in_list(const char *list, int num)
+{
+	const char *p = list;
+	char *end;
+	int found = 0;
+
+	while (*p != 0)
+	{
+		long first = strtol(p, &end, 10);
+		if ((end == p) || (first < 0)) return -1;
+		long last = first;
+		p = end;
+		if (*p == '-')
+		{
+			last = strtol(++p, &end, 10);
+			if ((end == p) || (last < first)) return -1;
+			p = end;
+		}
+		if ((num >= first) && (num <= last)) found = 1;
+		if (*p == ',')
+		{
+			if (*(++p) == 0) return -1;
+		}
+		else if (*p != 0)
+		{
+			return -1;
+		}
 	}
+	return found;
+}
+
+/* append the tape files listed by -c to the new image, each followed by a file mark */
+void slice_file(struct input *in, struct index *ix)
+{
+	int8_t hdr[4], *buf;
+	size_t ct = 1, sz;
+	int file = 0;		/* tape file number */
+	int last = list_last(SLICE_FILES);
+
+	if ((buf = malloc(RECORD_CHUNK)) == NULL) err(1, "unable to initialize buffer");
+	if (SLICE_OUTPUT.fd == -1) init_output(&SLICE_OUTPUT, STDOUT_FILENO);
+
+	if (ix != NULL)
+	{
+		/* the framed records of a tape file are all together, between its first record and the mark after it */
+		size_t p = 0;
+		uint32_t f;
+		for (f = 0; (f < ix->nfiles) && (f <= (uint32_t)last); f++)
+		{
+			uint8_t *e = ix->buf + p;
+			off_t start = get_int(e, 8);
+			off_t end = get_int(e + 8, 8);
+			uint32_t mark = get_int(e + 16, 4);
+			uint32_t nruns = get_int(e + 20, 4);
+
+			/* nothing between the last file mark and the end of the tape is another tape file */
+			if ((nruns == 0) && ((mark == UINT32_MAX) || (end == in->end))) break;
+			if (in_list(SLICE_FILES, f))
+			{
+				if (VERBOSE) fprintf(stderr, " (file %u, %lld bytes) (file mark)\n", f, (long long)(end - start));
+				copy_range(in, &SLICE_OUTPUT, start, end, buf);
+				put_int32(&SLICE_OUTPUT, 0);
+			}
+			p += INDEX_ENTRY + 8 * (size_t)nruns;
+			if (mark == UINT32_MAX) break;
+		}
+		free(buf);
+		return;
+	}
+
+	/*
+	 * Without an index, the length words are read only as far as the last
+	 * file listed. Records of a regular-file image are seeked past, and each
+	 * listed file is copied as one range once its end is found; from a pipe,
+	 * the records of a listed file are copied as they are read.
+	 */
+	int sel = in_list(SLICE_FILES, file);
+	if (in->end != -1) in->limit = 8;
+	off_t start = (in->end != -1) ? tell_input(in) : 0;	/* where the current tape file starts */
+	off_t nbytes = 0;					/* size of its records and markers */
+	while ((file <= last) && ((ct = read_input(in, &hdr, 4)) > 0))
+	{
+		if (ct < 4) err(1, "unexpected end of tape reading record length");
+		if (((sz = (uint32_t)get_int32(hdr)) == 0) || (sz == 0xFFFFFFFF))
+		{
+			/* nothing between the last file mark and the end of the tape is another tape file */
+			if ((sel) && ((sz == 0) || (nbytes != 0))) slice_end(in, file, start, nbytes, buf);
+			if (sz == 0xFFFFFFFF) break;
+			sel = in_list(SLICE_FILES, ++file);
+			if (in->end != -1) start = tell_input(in);
+			nbytes = 0;
+			continue;
+		}
+
+		/* the rest of a record; other markers, such as erase gaps, stay within their tape file */
+		size_t len = ((sz & 0xF0000000) == 0xF0000000) ? 0 : sz + (sz & 1) + 4;
+		if ((sel) && (in->end == -1))
+		{
+			put_bytes(&SLICE_OUTPUT, hdr, 4);
+			size_t p = 0;
+			while (p < len)
+			{
+				size_t k = (len - p > RECORD_CHUNK) ? RECORD_CHUNK : len - p;
+				if (read_input(in, buf, k) < k) err(1, "unexpected end of tape reading %zu-byte record", sz);
+				put_bytes(&SLICE_OUTPUT, buf, k);
+				p += k;
+			}
+		}
+		else if (skip_input(in, len) < len)
+		{
+			err(1, "unexpected end of tape reading %zu-byte record", sz);
+		}
+		nbytes += len + 4;
+	}
+
+	/* an image may end without a file mark (but not just after one) */
+	if ((ct == 0) && (sel) && (nbytes != 0)) slice_end(in, file, start, nbytes, buf);
+	free(buf);
+}
+
+/* finish copying a tape file to the new image: its records (if still to be copied) and a file mark */
+void slice_end(struct input *in, int file, off_t start, off_t nbytes, int8_t *buf)
+{
+	if (VERBOSE) fprintf(stderr, " (file %d, %lld bytes) (file mark)\n", file, (long long)nbytes);
+	if ((in->end != -1) && (nbytes != 0))
+	{
+		/* come back to where the scan had got to */
+		off_t pos = tell_input(in);
+		copy_range(in, &SLICE_OUTPUT, start, start + nbytes, buf);
+		seek_input(in, pos);
+	}
+	put_int32(&SLICE_OUTPUT, 0);
+}
+
+/* copy part of the image to the output as it is, inside the kernel where possible */
+void copy_range(struct input *in, struct output *out, off_t start, off_t end, int8_t *buf)
+{
+	seek_input(in, start);
+	int kind = can_copy(in, out->fd);
+	off_t p = start;
+	while (p < end)
+	{
+		if ((kind) && (in->pos == in->len))
+		{
+			/* whatever was put in the buffer has to be written first */
+			flush_output(out);
+			size_t r = copy_kernel(in, out->fd, (end - p > 1073741824) ? 1073741824 : end - p, kind);
+			if (r != 0)
+			{
+				p += r;
+				continue;
+			}
+			kind = 0;
+		}
+		size_t n = (end - p > RECORD_CHUNK) ? RECORD_CHUNK : end - p;
+		if ((kind) && (n > in->len - in->pos)) n = in->len - in->pos;
+		size_t r = read_input(in, buf, n);
+		if (r == 0) errx(1, "unexpected end of tape copying files");
+		put_bytes(out, buf, r);
+		p += r;
+	}
+}
+
+/* largest number in a list such as 1,3-5 (already checked by in_list()) */
+int list_last(const char *list)
+{
+	const char *p = list;
+	char *end;
+	long last = 0;
+
+	while (*p != 0)
+	{
+		long n = strtol(p, &end, 10);
+		if (n > last) last = n;
+		p = (*end != 0) ? end + 1 : end;
+	}
+	return (last > INT_MAX) ? INT_MAX : last;
+}
+
+/* extract tape files on several threads, reading the image at offsets taken from its index */
+void extract_parallel(struct input *in, struct index *ix)
+{
+	struct pool pl;
+	pthread_t thread[JOBS];
+	int i, nthreads = 0;
+
+	if ((pl.jobs = calloc(ix->nfiles, sizeof(struct job))) == NULL) err(1, "unable to initialize jobs");
+	pl.fd = in->fd;
+	pl.njobs = 0;
+	pl.next = 0;
+
+	/* tape files after an end-of-tape mark aren't read, as usual */
+	size_t p = 0;
+	uint32_t f;
+	for (f = 0; f < ix->nfiles; f++)
+	{
+		struct job *jb = &pl.jobs[pl.njobs++];
+		uint8_t *e = ix->buf + p;
+		off_t end = get_int(e + 8, 8);
+		uint32_t mark = get_int(e + 16, 4);
+		uint32_t nruns = get_int(e + 20, 4);
+		jb->entry = p;
+		jb->start = get_int(e, 8);
+		jb->end = end;
+		jb->file = f;
+		jb->skipped = (FILE_SKIP != 0);
+		for (i = 0; (uint32_t)i < nruns; i++) jb->records += get_int(e + INDEX_ENTRY + 8 * i + 4, 4);
+		jb->done = (jb->skipped) || (jb->records == 0);
+		p += INDEX_ENTRY + 8 * (size_t)nruns;
+		if ((mark == UINT32_MAX) || (end == in->end)) break;
+		if (FILE_SKIP > 0) FILE_SKIP--;
+	}
+
+	if ((errno = pthread_mutex_init(&pl.lock, NULL)) != 0) err(1, "unable to initialize jobs");
+	if ((errno = pthread_cond_init(&pl.cond, NULL)) != 0) err(1, "unable to initialize jobs");
+	for (i = 0; (i < JOBS) && (i < pl.njobs); i++)
+	{
+		if ((errno = pthread_create(&thread[i], NULL, extract_thread, &pl)) != 0) err(1, "unable to start extraction");
+		nthreads++;
+	}
+
+	/* report each tape file in order, as soon as it's done */
+	for (i = 0; i < pl.njobs; i++)
+	{
+		pthread_mutex_lock(&pl.lock);
+		while (!pl.jobs[i].done) pthread_cond_wait(&pl.cond, &pl.lock);
+		pthread_mutex_unlock(&pl.lock);
+		if (VERBOSE) report_job(ix, &pl.jobs[i], in->end);
+	}
+
+	for (i = 0; i < nthreads; i++) pthread_join(thread[i], NULL);
+	pthread_cond_destroy(&pl.cond);
+	pthread_mutex_destroy(&pl.lock);
+	free(pl.jobs);
+}
+
+/* extract tape files from the pool until none are left */
+void *extract_thread(void *arg)
+{
+	struct pool *pl = arg;
+	struct input in;
+	int8_t *buf;
+
+	if ((buf = malloc(RECORD_CHUNK)) == NULL) err(1, "unable to initialize buffer");
+	init_input(&in, pl->fd);
+	in.positional = 1;
+	for (;;)
+	{
+		pthread_mutex_lock(&pl->lock);
+		while ((pl->next < pl->njobs) && (pl->jobs[pl->next].done)) pl->next++;
+		if (pl->next == pl->njobs)
+		{
+			pthread_mutex_unlock(&pl->lock);
+			break;
+		}
+		struct job *jb = &pl->jobs[pl->next++];
+		pthread_mutex_unlock(&pl->lock);
+
+		/* like any seek, start by reading just the first length word, in case the records are large */
+		in.at = jb->start;
+		in.end = jb->end;
+		in.pos = in.len = 0;
+		in.limit = 8;
+		extract_job(&in, jb, buf);
+
+		pthread_mutex_lock(&pl->lock);
+		jb->done = 1;
+		pthread_cond_broadcast(&pl->cond);
+		pthread_mutex_unlock(&pl->lock);
+	}
+	free(buf);
+	free_input(&in);
+	return NULL;
+}
+
+/* extract one tape file's records to its own output */
+void extract_job(struct input *in, struct job *jb, int8_t *buf)
+{
+	int8_t hdr[4];
+	char name[PATH_MAX];
+
+	output_name(name, sizeof(name), jb->file);
+	int out = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out == -1) err(1, "error opening output file %s", name);
+
+	uint64_t i;
+	for (i = 0; i < jb->records; i++)
+	{
+		if (read_input(in, &hdr, 4) != 4) err(1, "unexpected end of tape reading record header");
+		copy_record(in, out, buf, get_int32(hdr) & 0xFFFFFFFF);
+	}
+	if (close(out) == -1) err(1, "error closing output file %s", name);
+}
+
+/* read a record's data and trailer, writing the data to out (unless -1) as -n and -p direct */
+void copy_record(struct input *in, int out, int8_t *buf, size_t sz)
+{
+	int8_t hdr[4];
+	size_t ct;
+
+	if ((ct = sz) & 1) ct++;
+	if (out == -1)
+	{
+		/* data that won't be written needn't be read */
+		ct = skip_input(in, ct);
+	}
+	else if ((ct <= RECORD_CHUNK) && ((ct < KERNEL_COPY_MIN) || (!can_copy(in, out))))
+	{
+		ct = read_input(in, buf, ct);
+	}
+	else
+	{
+		/* a large record is copied a piece at a time, so memory use doesn't depend on it */
+		size_t keep = ((RECORD_SIZE != 0) && (sz > RECORD_SIZE)) ? RECORD_SIZE : sz;
+		size_t p = 0;
+		int kind = can_copy(in, out);
+		while (p < ct)
+		{
+			if (p >= keep)
+			{
+				p += skip_input(in, ct - p);
+				break;
+			}
+			if ((kind) && (in->pos == in->len))
+			{
+				/* once the buffered part is written, the rest needn't pass through here */
+				size_t r = copy_kernel(in, out, keep - p, kind);
+				if (r != 0)
+				{
+					/* read just the trailer and the next length word, in case it's another large record */
+					in->limit = 8;
+					p += r;
+					continue;
+				}
+				kind = 0;
+			}
+			size_t n = (ct - p > RECORD_CHUNK) ? RECORD_CHUNK : ct - p;
+			if ((kind) && (n > in->len - in->pos)) n = in->len - in->pos;
+			size_t r = read_input(in, buf, n);
+			if (r == 0) break;
+			write_buffer(out, buf, (keep - p < r) ? keep - p : r);
+			p += r;
+			if (r < n) break;
+		}
+		ct = p;
+		out = -1;
+	}
+	if (ct == 0) err(1, "unexpected end of tape reading %zu-byte record", sz);
+	ct = read_input(in, &hdr, 4);
+	if (ct == 0) err(1, "unexpected end of tape reading record trailer");
+
+	if (out != -1)
+	{
+		if (RECORD_SIZE != 0)
+		{
+			if (sz > RECORD_SIZE) sz = RECORD_SIZE;
+			if (FILE_PAD) while(sz < RECORD_SIZE) buf[sz++] = 0;
+		}
+		write_buffer(out, buf, sz);
+	}
+}
+
+/* check whether record data can go from image to output inside the kernel (1 = file, 2 = pipe) */
+int can_copy(struct input *in, int out)
+{
+#ifdef __linux__
+	struct stat st;
+
+	/* only data that isn't changed by -n or -p, from an image that can be seeked */
+	if ((!KERNEL_COPY) || (RECORD_SIZE != 0) || (in->end == -1)) return 0;
+
+	/* reading ahead is already keeping the image and the output busy at once */
+	if (in->ra != NULL) return 0;
+	if (fstat(out, &st) == -1) return 0;
+	if (S_ISREG(st.st_mode)) return 1;
+	if (S_ISFIFO(st.st_mode)) return 2;
+#endif
+	return 0;
+}
+
+/* copy data from the image to the output inside the kernel, returning the amount copied */
+size_t copy_kernel(struct input *in, int out, size_t nbytes, int kind)
+{
+#ifdef __linux__
+	loff_t off = in->at;
+	ssize_t ct;
+
+	if (kind == 2) ct = splice(in->fd, (in->positional) ? &off : NULL, out, NULL, nbytes, SPLICE_F_MORE);
+	else ct = copy_file_range(in->fd, (in->positional) ? &off : NULL, out, NULL, nbytes, 0);
+	if (ct == -1)
+	{
+		/* e.g. different file systems on an older kernel; read and write as usual */
+		KERNEL_COPY = 0;
+		return 0;
+	}
+	if (in->positional) in->at = off;
+	return ct;
+#else
+	return 0;
+#endif
+}
+
+/* report a tape file's records, and the mark ending it, as extract_file() would */
+void report_job(struct index *ix, struct job *jb, off_t image_end)
+{
+	uint8_t *e = ix->buf + jb->entry;
+	off_t end = get_int(e + 8, 8);
+	uint32_t mark = get_int(e + 16, 4);
+	uint32_t nruns = get_int(e + 20, 4);
+	uint32_t i;
+
+	if ((!jb->skipped) && (jb->records != 0))
+	{
+		char name[PATH_MAX];
+		output_name(name, sizeof(name), jb->file);
+		fprintf(stderr, "%s:", name);
+	}
+	for (i = 0; i < nruns; i++)
+	{
+		size_t sz = get_int(e + INDEX_ENTRY + 8 * i, 4);
+		uint32_t ct = get_int(e + INDEX_ENTRY + 8 * i + 4, 4);
+		if (ct == 1)
+		{
+			fprintf(stderr, " (1 %zu-byte record%s)", sz, (jb->skipped) ? ", skipped": "");
+		}
+		else
+		{
+			fprintf(stderr, " (%u %zu-byte records%s)", ct, sz, (jb->skipped) ? ", skipped" : "");
+		}
+	}
+	if (mark == UINT32_MAX)
+	{
+		fprintf(stderr, " (tape end mark)\n");
+	}
+	else if (end != image_end)
+	{
+		fprintf(stderr, " (file mark)\n");
+	}
+	else if (nruns != 0)
+	{
+		fprintf(stderr, "\n");
+	}
+}
+
+/* make the output name for a tape file from the -x template */
+void output_name(char *name, size_t size, int file)
+{
+	if (snprintf(name, size, EXTRACT_NAME, file) >= (int)size) errx(1, "output file name too long");
+}
+
+/* go to the start of the num'th tape file from the end, reading the image backwards */
+void find_last(struct input *in, int num)
+{
+	if (in->end == -1) errx(1, "-e can only be used with an image that can be seeked");
+
+	/* marks after the last record don't end a file of their own */
+	off_t base = -1;
+	off_t pos = in->end;
+	int records = 0;
+	int files = 1;
+	while (pos >= 4)
+	{
+		uint32_t sz = word_at(in, pos - 4, &base);
+		if ((sz == 0) || ((sz & 0xF0000000) == 0xF0000000))
+		{
+			if ((sz == 0) && (records) && (++files > num)) break;
+			pos -= 4;
+			continue;
+		}
+
+		/* the trailing length word says where the record began */
+		off_t ct = sz + (sz & 1) + 8;
+		if ((ct > pos) || (word_at(in, pos - ct, &base) != sz)) errx(1, "bad record framing before offset %lld", (long long)pos);
+		pos -= ct;
+		records = 1;
+	}
+	if ((pos < 4) && (files < num)) errx(1, "tape has only %d file%s", files, (files == 1) ? "" : "s");
+	in->pos = in->len = 0;
+	if (in->positional) in->at = pos;
+	else if (lseek(in->fd, pos, SEEK_SET) == -1) err(1, NULL);
+}
+
+/* get the length word at an offset, reading the image in large pieces working backwards */
+uint32_t word_at(struct input *in, off_t offset, off_t *base)
+{
+	if ((*base == -1) || (offset < *base) || (offset + 4 > *base + (off_t)in->len))
+	{
+		/* the buffer keeps no data for reading forwards, so it can be reused */
+		off_t end = offset + 4;
+		*base = (end > (off_t)in->size) ? end - in->size : 0;
+		ssize_t ct = pread(in->fd, in->buf, end - *base, *base);
+		if (ct == -1) err(1, NULL);
+		if (ct != end - *base) errx(1, "unexpected end of tape reading backwards");
+		in->pos = in->len = ct;
+	}
+	return get_int32(in->buf + (offset - *base)) & 0xFFFFFFFF;
+}
+
+/* go straight to the mark ending the next tape file, reporting its records from the index */
+void skip_indexed(struct input *in, struct index *ix, int *n, size_t *last_sz)
+{
+	if (ix->next + INDEX_ENTRY > ix->len) return;
+	uint8_t *e = ix->buf + ix->next;
+	off_t start = get_int(e, 8);
+	off_t end = get_int(e + 8, 8);
+	uint32_t nruns = get_int(e + 20, 4);
+	ix->next += INDEX_ENTRY + 8 * (size_t)nruns;
+
+	/* the index is only good for an image read from its beginning */
+	if (tell_input(in) != start) return;
+
+	uint32_t i;
+	for (i = 0; i < nruns; i++)
+	{
+		size_t sz = get_int(e + INDEX_ENTRY + 8 * i, 4);
+		uint32_t ct = get_int(e + INDEX_ENTRY + 8 * i + 4, 4);
+		if (i + 1 == nruns)
+		{
+			/* the last run is reported when the mark is read, as usual */
+			*n = ct;
+			*last_sz = sz;
+		}
+		else if (VERBOSE)
+		{
+			if (ct == 1)
+			{
+				fprintf(stderr, " (1 %zu-byte record%s)", sz, (FILE_SKIP) ? ", skipped": "");
+			}
+			else
+			{
+				fprintf(stderr, " (%u %zu-byte records%s)", ct, sz, (FILE_SKIP) ? ", skipped" : "");
+			}
+		}
+	}
+	seek_input(in, end);
+}
+
+/* read an index file, if there is one that matches the image */
+int load_index(struct index *ix, struct input *in)
+{
+	struct stat st;
+	uint8_t hdr[INDEX_HEADER];
+
+	int fd = open(ix->name, O_RDONLY);
+	if (fd == -1) return 0;
+	if ((fstat(fd, &st) == -1) || (st.st_size < INDEX_HEADER)) goto stale;
+	if (read_buffer(fd, hdr, INDEX_HEADER) != INDEX_HEADER) goto stale;
+	if ((get_int(hdr, 4) != 0x58495456) || (get_int(hdr + 4, 4) != INDEX_VERSION)) goto stale;
+	ix->nfiles = get_int(hdr + 28, 4);
+	ix->size = ix->len = st.st_size - INDEX_HEADER;
+	if ((ix->buf = malloc(ix->size + 1)) == NULL) err(1, "unable to initialize index");
+	if (read_buffer(fd, ix->buf, ix->len) != ix->len) goto stale;
+
+	/* the image must not have changed since it was indexed */
+	if (fstat(in->fd, &st) == -1) goto stale;
+	if ((off_t)get_int(hdr + 8, 8) != st.st_size) goto stale;
+	if (((int64_t)get_int(hdr + 16, 8) != st.st_mtim.tv_sec) || (get_int(hdr + 24, 4) != (uint64_t)st.st_mtim.tv_nsec)) goto stale;
+
+	/* check the entries fit together, so a damaged index can't send reads astray */
+	size_t p = 0;
+	off_t offset = 0;
+	uint32_t i;
+	for (i = 0; i < ix->nfiles; i++)
+	{
+		if (p + INDEX_ENTRY > ix->len) goto stale;
+		off_t start = get_int(ix->buf + p, 8);
+		off_t end = get_int(ix->buf + p + 8, 8);
+		uint32_t nruns = get_int(ix->buf + p + 20, 4);
+		if ((start < offset) || (end < start) || (end > st.st_size)) goto stale;
+		p += INDEX_ENTRY;
+		if ((ix->len - p) / 8 < nruns) goto stale;
+		p += 8 * (size_t)nruns;
+		offset = end;
+	}
+	if (p != ix->len) goto stale;
+	close(fd);
+	return 1;
+
+stale:
+	close(fd);
+	free(ix->buf);
+	ix->buf = NULL;
+	ix->len = ix->size = 0;
+	ix->nfiles = 0;
+	return 0;
+}
+
+/* index an image by reading only its length words, then return to its beginning */
+int build_index(struct index *ix, struct input *in)
+{
+	int8_t hdr[4];
+	size_t ct, sz;
+
+	/* only length words are wanted, so start with a small refill rather than a full one */
+	in->limit = 8;
+	off_t offset = 0;
+	while ((ct = read_input(in, &hdr, 4)) > 0)
+	{
+		if (ct != 4) break;
+		sz = get_int32(hdr) & 0xFFFFFFFF;
+		if (sz == 0)
+		{
+			index_mark(ix, offset, 0);
+			offset += 4;
+			continue;
+		}
+		if (sz == 0xFFFFFFFF)
+		{
+			index_mark(ix, offset, sz);
+			break;
+		}
+		if ((sz & 0xF0000000) == 0xF0000000)
+		{
+			if (ix->name != NULL) warnx("%s not written: image has a tape marker 0x%zX at offset %lld", ix->name, sz, (long long)offset);
+			goto fail;
+		}
+		if ((ct = sz) & 1) ct++;
+		/* large records are seeked over; small ones are cheaper to read through */
+		if (skip_input(in, ct) != ct) break;
+		if (read_input(in, &hdr, 4) != 4) break;
+		if ((size_t)(get_int32(hdr) & 0xFFFFFFFF) != sz)
+		{
+			if (ix->name != NULL) warnx("%s not written: record at offset %lld has a mismatched trailer", ix->name, (long long)offset);
+			goto fail;
+		}
+		index_record(ix, offset, sz);
+		offset += ct + 8;
+	}
+	if ((!ix->ended) && (offset != in->end))
+	{
+		if (ix->name != NULL) warnx("%s not written: image ends part way through a record", ix->name);
+		goto fail;
+	}
+
+	/* unless the tape ended with an end-of-tape mark, the last tape file ends with the image */
+	if (!ix->ended)
+	{
+		if (!ix->open) index_start(ix, offset);
+		index_mark(ix, offset, 0);
+	}
+	seek_input(in, 0);
+	return 1;
+
+fail:
+	seek_input(in, 0);
+	free(ix->buf);
+	ix->buf = NULL;
+	return 0;
+}
+
+/* write the index file for an image */
+void write_index(struct index *ix, struct input *in)
+{
+	struct stat st;
+	uint8_t hdr[INDEX_HEADER];
+
+	if (fstat(in->fd, &st) == -1) err(1, NULL);
+	set_int(hdr, 0x58495456, 4);	/* "VTIX" */
+	set_int(hdr + 4, INDEX_VERSION, 4);
+	set_int(hdr + 8, st.st_size, 8);
+	set_int(hdr + 16, st.st_mtim.tv_sec, 8);
+	set_int(hdr + 24, st.st_mtim.tv_nsec, 4);
+	set_int(hdr + 28, ix->nfiles, 4);
+
+	/* the image can still be read without its index, so failing to save one isn't fatal */
+	int fd = open(ix->name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1)
+	{
+		warn("error opening index file %s", ix->name);
+		return;
+	}
+	write_buffer(fd, hdr, sizeof(hdr));
+	write_buffer(fd, ix->buf, ix->len);
+	if (close(fd) == -1) err(1, "error closing index file %s", ix->name);
+}
+
+/* add a record to the index, starting a new tape file entry if needed */
+void index_record(struct index *ix, off_t offset, uint32_t size)
+{
+	if (!ix->open) index_start(ix, offset);
+
+	if ((ix->run_count != 0) && ((size != ix->run_size) || (ix->run_count == UINT32_MAX))) index_run(ix);
+	ix->run_size = size;
+	ix->run_count++;
+}
+
+/* add a mark to the index, ending the current tape file */
+void index_mark(struct index *ix, off_t offset, uint32_t mark)
+{
+	if (!ix->open) index_start(ix, offset);
+
+	if (ix->run_count != 0) index_run(ix);
+	index_int(ix, ix->entry + 8, offset, 8);
+	index_int(ix, ix->entry + 16, mark, 4);
+	index_int(ix, ix->entry + 20, ix->nruns, 4);
+	ix->open = 0;
+	if (mark == UINT32_MAX) ix->ended = 1;
+}
+
+/* start an index entry for a tape file */
+void index_start(struct index *ix, off_t offset)
+{
+	ix->entry = ix->len;
+	index_int(ix, ix->len, offset, 8);
+	index_int(ix, ix->len, 0, 8);
+	index_int(ix, ix->len, 0, 8);
+	ix->open = 1;
+	ix->nfiles++;
+	ix->nruns = 0;
+	ix->run_count = 0;
+}
+
+/* add the current run of same-size records to the open index entry */
+void index_run(struct index *ix)
+{
+	index_int(ix, ix->len, ix->run_size, 4);
+	index_int(ix, ix->len, ix->run_count, 4);
+	ix->nruns++;
+	ix->run_count = 0;
+}
+
+/* store a little-endian integer in the index (at the end, if pos == len) */
+void index_int(struct index *ix, size_t pos, uint64_t value, int nbytes)
+{
+	if (pos + nbytes > ix->size)
+	{
+		ix->size = (ix->size == 0) ? 65536 : ix->size * 2;
+		if ((ix->buf = realloc(ix->buf, ix->size)) == NULL) err(1, "unable to resize index");
+	}
+	if (pos + nbytes > ix->len) ix->len = pos + nbytes;
+	set_int(ix->buf + pos, value, nbytes);
+}
+
+/* store a little-endian integer */
+void set_int(uint8_t *buf, uint64_t value, int nbytes)
+{
+	while (nbytes-- > 0)
+	{
+		*buf++ = value & 0xff;
+		value >>= 8;
+	}
+}
+
+/* get a little-endian integer of any size */
+uint64_t get_int(const uint8_t *buf, int nbytes)
+{
+	uint64_t value = 0;
+	while (nbytes-- > 0)
+	{
+		value = (value << 8) | buf[nbytes];
+	}
+	return value;
+}
+
+/* check that an output name template has exactly one integer conversion (for the file number) */
+int check_template(const char *name)
+{
+	int n = 0;
+	while ((name = strchr(name, '%')) != NULL)
+	{
+		name++;
+		if (*name == '%')
+		{
+			name++;
+			continue;
+		}
+		name += strspn(name, "-+ #0");
+		name += strspn(name, "0123456789");
+		if ((*name == 0) || (strchr("diouxX", *name) == NULL)) return 0;
+		n++;
+	}
+	return (n == 1);
+}
+
+/* set up buffered input from a file descriptor */
+void init_input(struct input *in, int fd)
+{
+	in->fd = fd;
+	in->pos = 0;
+	in->len = 0;
+	in->size = INPUT_SIZE;
+	in->limit = 0;
+	in->positional = 0;
+	in->ra = NULL;
+	if ((in->buf = malloc(in->size)) == NULL) err(1, "unable to initialize input buffer");
+
+	/* only a regular file is known to seek, and to have a meaningful size */
+	struct stat st;
+	in->end = -1;
+	if ((fstat(fd, &st) == 0) && (S_ISREG(st.st_mode)) && (lseek(fd, 0, SEEK_CUR) != -1)) in->end = st.st_size;
+}
+
+/* release buffered input (the file descriptor is left open) */
+void free_input(struct input *in)
+{
+	if (in->ra != NULL) stop_reader(in);
+	else free(in->buf);
+	in->buf = NULL;
+	in->fd = -1;
+}
+
+/* read up to nbytes of input, taking length words and small records from the buffer */
+size_t read_input(struct input *in, void *buf, size_t nbytes)
+{
+	/* record data is wanted, not just length words, so refills can be full again */
+	if (nbytes > 4) in->limit = 0;
+
+	size_t p = 0;
+	while (p < nbytes)
+	{
+		size_t ct = in->len - in->pos;
+		if (ct == 0)
+		{
+			/* large reads bypass the buffer rather than being copied through it */
+			if ((nbytes - p >= in->size) && (in->positional) && (in->ra == NULL))
+			{
+				size_t n = nbytes - p;
+				while (n > 0)
+				{
+					ssize_t ct = pread(in->fd, (int8_t *)buf + p, n, in->at);
+					if (ct == -1) err(1, NULL);
+					if (ct == 0) break;
+					in->at += ct;
+					p += ct;
+					n -= ct;
+				}
+				return p;
+			}
+			if ((nbytes - p >= in->size) && (in->ra == NULL)) return p + read_buffer(in->fd, (int8_t *)buf + p, nbytes - p);
+			if (fill_input(in) == 0) break;
+			continue;
+		}
+		if (ct > nbytes - p) ct = nbytes - p;
+		memcpy((int8_t *)buf + p, in->buf + in->pos, ct);
+		in->pos += ct;
+		p += ct;
+	}
+	return p;
+}
+
+/* skip up to nbytes of input, seeking past whatever isn't already buffered */
+size_t skip_input(struct input *in, size_t nbytes)
+{
+	size_t ct = in->len - in->pos;
+	if ((nbytes <= ct) || (in->end == -1))
+	{
+		/* can't seek, so read and discard */
+		ct = 0;
+		while (ct < nbytes)
+		{
+			if ((in->pos == in->len) && (fill_input(in) == 0)) break;
+			size_t n = in->len - in->pos;
+			if (n > nbytes - ct) n = nbytes - ct;
+			in->pos += n;
+			ct += n;
+		}
+		return ct;
+	}
+
+	/* stop at the end of the image, as a read would */
+	in->pos = in->len = 0;
+	off_t pos = (in->positional) ? in->at : lseek(in->fd, 0, SEEK_CUR);
+	if (pos == -1) err(1, NULL);
+	off_t n = nbytes - ct;
+	if (n > in->end - pos) n = (pos < in->end) ? in->end - pos : 0;
+	if (in->positional) in->at += n;
+	else if (lseek(in->fd, n, SEEK_CUR) == -1) err(1, NULL);
+
+	/* what comes next is a trailer and another length word; unless records are small, don't read past them */
+	in->limit = (nbytes >= SEEK_MIN) ? 8 : 0;
+	return ct + n;
+}
+
+/* refill the input buffer once it is empty, returning the number of bytes now in it */
+size_t fill_input(struct input *in)
+{
+	if (in->ra != NULL) return next_buffer(in);
+
+	size_t ct = ((in->limit != 0) && (in->limit < in->size)) ? in->limit : in->size;
+	if ((in->positional) && (in->end != -1) && (in->at + (off_t)ct > in->end)) ct = (in->at < in->end) ? in->end - in->at : 0;
+	ssize_t n = (in->positional) ? pread(in->fd, in->buf, ct, in->at) : read(in->fd, in->buf, ct);
+	if (n == -1) err(1, NULL);
+	if (in->positional) in->at += n;
+	in->pos = 0;
+	in->len = n;
+	return n;
+}
+
+/* offset in the image of the next byte to be read (seekable input only) */
+off_t tell_input(struct input *in)
+{
+	off_t pos = (in->positional) ? in->at : lseek(in->fd, 0, SEEK_CUR);
+	if (pos == -1) err(1, NULL);
+	return pos - (in->len - in->pos);
+}
+
+/* go to an offset in the image (seekable input only) */
+void seek_input(struct input *in, off_t offset)
+{
+	off_t pos = (in->positional) ? in->at : lseek(in->fd, 0, SEEK_CUR);
+	if (pos == -1) err(1, NULL);
+	if ((offset <= pos) && (offset >= pos - (off_t)in->len))
+	{
+		/* still in the buffer */
+		in->pos = in->len - (pos - offset);
+		return;
+	}
+	in->pos = in->len = 0;
+	if (in->positional) in->at = offset;
+	else if (lseek(in->fd, offset, SEEK_SET) == -1) err(1, NULL);
+
+	/* a seek lands on a length word; the refill can grow again once record data is read */
+	in->limit = 8;
+}
+
+/* start reading input ahead of use, in up to 'depth' buffers */
+void start_reader(struct input *in, int depth)
+{
+	struct readahead *ra;
+	int i;
+
+	if ((ra = calloc(1, sizeof(struct readahead))) == NULL) err(1, "unable to initialize read-ahead");
+	ra->fd = in->fd;
+	ra->size = in->size;
+	ra->depth = depth;
+	if ((ra->buf = calloc(depth + 1, sizeof(int8_t *))) == NULL) err(1, "unable to initialize read-ahead");
+	if ((ra->len = calloc(depth + 1, sizeof(size_t))) == NULL) err(1, "unable to initialize read-ahead");
+	if ((ra->offset = calloc(depth + 1, sizeof(off_t))) == NULL) err(1, "unable to initialize read-ahead");
+	for (i = 0; i <= depth; i++)
+	{
+		if ((ra->buf[i] = malloc(ra->size)) == NULL) err(1, "unable to initialize read-ahead");
+	}
+	ra->own = in->buf;
+
+	/* a seekable image is read by offset, so seeks only have to tell the thread where to go */
+	if (in->end != -1)
+	{
+		ra->seekable = 1;
+		if (!in->positional)
+		{
+			if ((in->at = lseek(in->fd, 0, SEEK_CUR)) == -1) err(1, NULL);
+			in->positional = 1;
+		}
+		ra->next = in->at;
+	}
+
+	if ((errno = pthread_mutex_init(&ra->lock, NULL)) != 0) err(1, "unable to initialize read-ahead");
+	if ((errno = pthread_cond_init(&ra->cond, NULL)) != 0) err(1, "unable to initialize read-ahead");
+	if ((errno = pthread_create(&ra->thread, NULL, reader_thread, ra)) != 0) err(1, "unable to start read-ahead");
+	in->ra = ra;
+}
+
+/* fill buffers until end of input, staying at most 'depth' buffers ahead */
+void *reader_thread(void *arg)
+{
+	struct readahead *ra = arg;
+	int state;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	pthread_mutex_lock(&ra->lock);
+	while (!ra->stop)
+	{
+		if ((ra->count == ra->depth) || (ra->eof))
+		{
+			pthread_cond_wait(&ra->cond, &ra->lock);
+			continue;
+		}
+		int i = (ra->head + ra->count) % (ra->depth + 1);
+		off_t offset = ra->next;
+		unsigned gen = ra->gen;
+		pthread_mutex_unlock(&ra->lock);
+
+		/* only a read in progress may be cancelled, as it could wait forever on a pipe */
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+		ssize_t ct = (ra->seekable) ? pread(ra->fd, ra->buf[i], ra->size, offset) : read(ra->fd, ra->buf[i], ra->size);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+		if (ct == -1) err(1, NULL);
+
+		pthread_mutex_lock(&ra->lock);
+		if (gen != ra->gen) continue;
+		ra->len[i] = ct;
+		ra->offset[i] = offset;
+		ra->next = offset + ct;
+		ra->count++;
+		if (ct == 0) ra->eof = 1;
+		pthread_cond_broadcast(&ra->cond);
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return NULL;
+}
+
+/* make the next buffer read ahead the input buffer, returning the number of bytes in it */
+size_t next_buffer(struct input *in)
+{
+	struct readahead *ra = in->ra;
+
+	pthread_mutex_lock(&ra->lock);
+	if ((ra->seekable) && (((ra->count != 0) && (ra->offset[ra->head] != in->at)) || ((ra->count == 0) && (ra->next != in->at))))
+	{
+		/* the input has seeked, so start again from there */
+		ra->count = 0;
+		ra->eof = 0;
+		ra->next = in->at;
+		ra->gen++;
+		pthread_cond_broadcast(&ra->cond);
+	}
+	while ((ra->count == 0) && (!ra->eof)) pthread_cond_wait(&ra->cond, &ra->lock);
+	if (ra->count == 0)
+	{
+		/* end of input was handed over already */
+		pthread_mutex_unlock(&ra->lock);
+		in->pos = in->len = 0;
+		return 0;
+	}
+
+	/* the buffer handed over last time is now free to be refilled */
+	int i = ra->head;
+	ra->head = (ra->head + 1) % (ra->depth + 1);
+	ra->count--;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+
+	in->buf = ra->buf[i];
+	in->pos = 0;
+	in->len = ra->len[i];
+	in->at = ra->offset[i] + in->len;
+	return in->len;
+}
+
+/* stop the reader thread and free its buffers */
+void stop_reader(struct input *in)
+{
+	struct readahead *ra = in->ra;
+	int i;
+
+	pthread_mutex_lock(&ra->lock);
+	ra->stop = 1;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+	pthread_cancel(ra->thread);
+	if ((errno = pthread_join(ra->thread, NULL)) != 0) err(1, "unable to stop read-ahead");
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->lock);
+
+	for (i = 0; i <= ra->depth; i++) free(ra->buf[i]);
+	free(ra->buf);
+	free(ra->len);
+	free(ra->offset);
+	free(ra->own);
+	free(ra);
+	in->ra = NULL;
+	in->buf = NULL;
+}
+
+/* read a full buffer (even from a pipe) */
+size_t read_buffer(int fd, void *buf, size_t nbytes)
+{
+	size_t p = 0;
+	while (p < nbytes)
+	{
+		ssize_t ct = read(fd, buf + p, nbytes - p);
+		if (ct == -1) err(1, NULL);
+		if (ct == 0) break;
+		p += ct;
+	}
+	return p;
+}
+
+/* write a buffer */
+void write_buffer(int fd, const void *buf, size_t nbytes)
+{
+	size_t p = 0;
+	while (p < nbytes)
+	{
+		ssize_t ct = write(fd, buf + p, nbytes - p);
+		if (ct == -1) err(1, NULL);
+		p += ct;
+	}
+}
+
+/* set up buffered output to a file descriptor */
+void init_output(struct output *out, int fd)
+{
+	out->fd = fd;
+	out->len = 0;
+	out->size = OUTPUT_SIZE;
+	if ((out->buf = malloc(out->size)) == NULL) err(1, "unable to initialize output buffer");
+}
+
+/* add bytes to the output, writing the buffer out whenever it fills */
+void put_bytes(struct output *out, const void *buf, size_t nbytes)
+{
+	size_t p = 0;
+	while (p < nbytes)
+	{
+		if (out->len == out->size) flush_output(out);
+		size_t ct = (nbytes - p < out->size - out->len) ? nbytes - p : out->size - out->len;
+		memcpy(out->buf + out->len, (const int8_t *)buf + p, ct);
+		out->len += ct;
+		p += ct;
+	}
+}
+
+/* add a 32-bit integer to the output in little-endian format */
+void put_int32(struct output *out, uint32_t value)
+{
+	uint8_t buf[4];
+	int i;
+
+	for (i = 0; i < 4; i++)
+	{
+		buf[i] = value & 255;
+		value >>= 8;
+	}
+	put_bytes(out, buf, 4);
+}
+
+/* write out whatever is in the output buffer */
+void flush_output(struct output *out)
+{
+	write_buffer(out->fd, out->buf, out->len);
+	out->len = 0;
 }
 
 /* get a 32-bit integer in little-endian format */
@@ -21,27 +21,304 @@
  * SOFTWARE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* O_DIRECT */
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <fts.h>
+#include <grp.h>
+#include <limits.h>
+#include <pwd.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#ifdef HAVE_SHA2
+#include <sha2.h>
+#endif
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC32C
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/* running checksums of a stream of bytes */
+struct digest
+{
+	uint32_t crc;		/* CRC32C */
+#ifdef HAVE_SHA2
+	SHA2_CTX sha;		/* SHA-256 */
+#endif
+};
+
+/* buffered output, so that record framing doesn't cost a system call per byte */
+struct output
+{
+	int fd;			/* output file descriptor */
+	int8_t *buf;		/* output buffer (allocated on first use) */
+	size_t len;		/* number of bytes waiting in buf */
+	size_t size;		/* size of buf */
+	struct iovec *iov;	/* pending output: slices of buf, or of mapped input files */
+	int iovcnt;		/* number of entries in iov */
+	off_t offset;		/* number of bytes output so far */
+	off_t base;		/* file offset where output began (direct or sparse output) */
+	off_t end;		/* file size after preallocation (direct output) */
+	off_t keep;		/* file size before any output (direct or sparse output) */
+	int direct;		/* flag: fd is open with O_DIRECT */
+	int sparse;		/* flag: zeros past the end of the file may be left as holes */
+	int positional;		/* flag: write at file offset 'at' instead of the current offset */
+	off_t at;		/* file offset of the next write (positional output) */
+	off_t limit;		/* value of 'offset' that output must not go past (-1 for none) */
+	char *limit_name;	/* file whose output is limited, for messages */
+	struct digest *digest;	/* checksums of everything output (NULL for none) */
+};
+
+/*
+ * index of the image being written, so readers can go straight to a tape file
+ * (a tape file being the records between two file marks) instead of reading
+ * every length word from the start.  all values are little-endian:
+ *
+ * header:  "VTIX", uint32 version (1), uint64 image size,
+ *          int64 image mtime seconds, uint32 image mtime nanoseconds,
+ *          uint32 number of tape files
+ * per tape file:
+ *          uint64 offset of first record, uint64 offset of the mark that ends
+ *          the file (or the image size, if the image ends first),
+ *          uint32 mark (0 = file mark, 0xFFFFFFFF = end of tape),
+ *          uint32 number of runs, then for each run of same-size records:
+ *          uint32 record size, uint32 number of records
+ */
+struct index
+{
+	char *name;		/* index file name (NULL for no index) */
+	uint8_t *buf;		/* tape file entries */
+	size_t len;		/* number of bytes in buf */
+	size_t size;		/* size of buf */
+	int open;		/* flag: an entry has been started but not ended */
+	size_t entry;		/* position in buf of the open entry */
+	uint32_t nfiles;	/* number of tape files */
+	uint32_t nruns;		/* number of runs in the open entry */
+	uint32_t run_size;	/* record size of the current run */
+	uint32_t run_count;	/* number of records in the current run */
+	int ended;		/* flag: end-of-tape mark has been indexed */
+};
+
+#define INDEX_VERSION 1
+#define INDEX_HEADER 32		/* size of index header */
+#define INDEX_ENTRY 24		/* size of tape file entry, not counting runs */
+
+/* one step in writing a tape image, in command-line order */
+struct action
+{
+	int type;		/* ACTION_FILE, ACTION_STDIN, ACTION_MARK or ACTION_END */
+	char *name;		/* file name (ACTION_FILE) */
+	size_t record_size;	/* record size in effect */
+	int read_ahead;		/* read-ahead depth in effect */
+	int verbose;		/* flag: display status */
+	int marks;		/* number of -m options given since the previous file */
+	int pad;		/* flag: -p given since the previous file */
+	int decompress;		/* flag: -z given since the previous file */
+	off_t offset;		/* offset in output where this step begins (if known in advance) */
+	pid_t pid;		/* process writing this step (parallel output) */
+	FILE *log;		/* its status and error messages */
+	int status;		/* its exit status */
+	int done;		/* flag: it has finished */
+};
+
+#define ACTION_FILE 0
+#define ACTION_STDIN 1
+#define ACTION_MARK 2
+#define ACTION_END 3
+
+/* tar archive of a directory tree, generated as it is read */
+struct tar
+{
+	FTS *fts;		/* directory tree walk */
+	size_t record_size;	/* archive is padded to a multiple of this */
+	uint8_t hdr[512];	/* header block being output */
+	size_t hdr_pos;		/* bytes of hdr already output */
+	int fd;			/* file whose data is being output (-1 if none) */
+	char *path;		/* name of that file, for messages */
+	off_t data;		/* bytes of file data still to be output */
+	size_t zeros;		/* zero bytes still to be output (padding) */
+	off_t total;		/* bytes output so far */
+	int done;		/* flag: end of archive has been reached */
+	struct tar_link *links;	/* files with more than one link */
+	int nlinks;		/* number of entries in links */
+};
 
+/* file with more than one link, so later links can be archived as links to it */
+struct tar_link
+{
+	dev_t dev;
+	ino_t ino;
+	char *name;		/* name in archive */
+};
+
+#define TAR_READ_AHEAD 16	/* directories are always archived this far ahead of output */
+
+/* input file, decompressed as it is read if it turns out to be compressed */
+struct input
+{
+	int fd;			/* input file descriptor */
+	int format;		/* INPUT_PLAIN, INPUT_GZIP, INPUT_XZ or INPUT_TAR */
+	uint8_t *buf;		/* data read from fd but not yet consumed */
+	size_t pos;		/* position of next unconsumed byte of buf (INPUT_PLAIN) */
+	size_t len;		/* number of bytes in buf (INPUT_PLAIN) */
+	int eof;		/* flag: fd has reached end of file */
+	int done;		/* flag: decompressor has reached end of data */
+#ifdef HAVE_ZLIB
+	z_stream z;		/* INPUT_GZIP decompressor state */
+#endif
+#ifdef HAVE_LZMA
+	lzma_stream x;		/* INPUT_XZ decompressor state */
+#endif
+	struct tar *tar;	/* INPUT_TAR archive state */
+};
+
+#define INPUT_PLAIN 0
+#define INPUT_GZIP 1
+#define INPUT_XZ 2
+#define INPUT_TAR 3
+#define INPUT_SIZE 65536	/* compressed input is read in chunks of this size */
+
+/* records read ahead of output by a separate thread, so slow input overlaps slow output */
+struct readahead
+{
+	struct input *in;	/* input file */
+	size_t size;		/* record size */
+	int depth;		/* number of records that may be read ahead (0 for none) */
+	int8_t *buf;		/* record buffers, one more than depth */
+	size_t *len;		/* length of each record read (0 at end of input) */
+	int head;		/* next record to be read */
+	int tail;		/* next record to be written */
+	int count;		/* number of records read but not yet written */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+};
+
+int write_tape(char **argv);
+int write_batch(char *cmd, char *manifest);
 void usage(const char *command, int status);
-void write_file(int fd);
+void add_action(int type, char *name);
+void run_action(struct action *act);
+off_t plan_tape(void);
+off_t framed_size(off_t size, size_t record_size);
+void write_parallel(off_t size);
+void copy_log(FILE *log);
+void write_file(int fd, const char *name);
+int write_mapped(int fd, const char *name, int8_t *buf, size_t size, struct digest *digest, size_t *last_ct);
+void mapped_fault(int sig);
+void write_mark(int mark);
+void init_digest(struct digest *d);
+void update_digest(struct digest *d, const void *buf, size_t nbytes);
+void report_digest(struct digest *d, const char *name);
+uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t nbytes);
+void open_input(struct input *in, int fd, const char *name, int decompress);
+size_t read_input(struct input *in, void *buf, size_t nbytes);
+size_t inflate_input(struct input *in, void *buf, size_t nbytes);
+size_t unxz_input(struct input *in, void *buf, size_t nbytes);
+void fill_input(struct input *in);
+void close_input(struct input *in);
+struct tar *open_tar(const char *name, size_t record_size);
+size_t read_tar(struct tar *t, uint8_t *buf, size_t nbytes);
+void next_tar_entry(struct tar *t);
+int tar_header(struct tar *t, FTSENT *e);
+void tar_number(uint8_t *field, size_t len, uint64_t value);
+int tar_compare(const FTSENT **a, const FTSENT **b);
+void close_tar(struct tar *t);
+void start_reader(struct readahead *ra, struct input *in, size_t size, int depth);
+void *reader_thread(void *arg);
+int8_t *next_record(struct readahead *ra, size_t *ct);
+void done_record(struct readahead *ra);
+void stop_reader(struct readahead *ra);
 size_t read_buffer(int fd, void *buf, size_t nbytes);
 void write_buffer(int fd, const void *buf, size_t nbytes);
-void write_int8(int fd, int8_t value);
-void write_int32(int fd, int value);
+void put_buffer(struct output *out, const void *buf, size_t nbytes);
+void put_mapped(struct output *out, const void *buf, size_t nbytes);
+void put_zero(struct output *out, size_t nbytes);
+void put_hole(struct output *out, size_t nbytes);
+void check_room(struct output *out, size_t nbytes);
+int is_zero(const void *buf, size_t nbytes);
+void put_int8(struct output *out, int8_t value);
+void put_int32(struct output *out, int value);
+void init_output(struct output *out);
+void flush_output(struct output *out);
+void index_record(struct index *ix, off_t offset, uint32_t size);
+void index_mark(struct index *ix, off_t offset, uint32_t mark);
+void index_start(struct index *ix, off_t offset);
+void index_run(struct index *ix);
+void index_int(struct index *ix, size_t pos, uint64_t value, int nbytes);
+void set_int(uint8_t *buf, uint64_t value, int nbytes);
+void write_index(struct index *ix, struct output *out);
+void append_output(struct output *out, const char *name);
+uint32_t pread_int32(int fd, off_t offset, const char *name);
+int file_output(struct output *out);
+void direct_output(struct output *out, off_t size, int flags);
+void set_direct(struct output *out, int direct);
+void finish_output(struct output *out);
+void flush_at_exit(void);
 
 size_t RECORD_SIZE = 512;	/* default: 512-byte records */
 int FILE_MARK = 0;		/* default: do not append tape mark after next file */
 int FILE_PAD = 0;		/* default: do not pad final record of next file */
 int TAPE_MARK = 0;		/* default: do not append end-of-tape mark at end */
 int VERBOSE = 0;		/* default: do not write status to standard error */
+int READ_AHEAD = 0;		/* default: do not read ahead of output */
+int DECOMPRESS = 0;		/* default: do not decompress next file */
+int DIRECT = 0;			/* default: write output through the buffer cache */
+int SPARSE = 0;			/* default: write all-zero records like any other */
+int PARALLEL = 0;		/* default: write files one after another */
+char *APPEND = NULL;		/* default: write a new image to standard output */
+int JOBS = 0;			/* default: build batch images on every processor */
+int CHECKSUM = 0;		/* default: do not compute checksums */
+FILE *DIGESTS = NULL;		/* default: do not write checksums to a file */
+char *OUTPUT_NAME = "standard output";	/* name of output, for checksum reports */
+int EXITING = 0;		/* set while output is flushed on the way out, when write errors can only be ignored */
+sigjmp_buf MAPPED_FAULT;	/* where to go if a mapped file is truncated under us */
+
+#define OUTPUT_SIZE 1048576	/* output is written in chunks of this size */
+#define OUTPUT_IOV 1024		/* ... or of this many slices, whichever fills first */
+#define DIRECT_ALIGN 4096	/* alignment of buffers, offsets and sizes for O_DIRECT */
+#define SPARSE_BLOCK 4096	/* only whole blocks of zeros are left as holes */
+#define MAP_CHECK 1048576	/* a mapped file's size is checked again after this much of it */
+struct output OUTPUT = { .fd = STDOUT_FILENO, .size = OUTPUT_SIZE, .limit = -1 };
+struct index INDEX = { NULL };
+
+struct action *ACTIONS = NULL;	/* command line, as a list of steps */
+int NACTIONS = 0;		/* number of steps */
 
 int main(int argc, char **argv)
+{
+	(void)argc;	/* the command line ends with a NULL */
+	if (atexit(flush_at_exit) != 0) errx(1, "unable to register exit handler");
+	return write_tape(argv);
+}
+
+/* write a tape image to standard output, as described by a command line */
+int write_tape(char **argv)
 {
 	int fflag = 0;	/* flag: command-line specified a file */
 	char *cmd = *argv;
@@ -54,8 +331,7 @@ int main(int argc, char **argv)
 			if (arg[1] == 0)
 			{
 				/* "-" by itself reads from stdin */
-				if (VERBOSE) fprintf(stderr, "write from standard input");
-				write_file(STDIN_FILENO);
+				add_action(ACTION_STDIN, NULL);
 				fflag = 1;
 				continue;
 			}
@@ -84,8 +360,7 @@ int main(int argc, char **argv)
 				}
 				if (*arg == 'M') /* -M */
 				{
-					if (VERBOSE) fprintf(stderr, "write file mark\n");
-					write_int32(STDOUT_FILENO, 0);
+					add_action(ACTION_MARK, NULL);
 					continue;
 				}
 				if (*arg == 't') /* -t */
@@ -102,16 +377,86 @@ int main(int argc, char **argv)
 					RECORD_SIZE = n;
 					break;
 				}
+				if (*arg == 'D') /* -D */
+				{
+					DIRECT = 1;
+					continue;
+				}
+				if (*arg == 'a') /* -a image */
+				{
+					if (*(++arg) == 0) arg = *(++argv);
+					if (arg == NULL) usage(cmd, 1);
+					APPEND = arg;
+					break;
+				}
+				if (*arg == 'P') /* -P */
+				{
+					PARALLEL = 1;
+					continue;
+				}
+				if (*arg == 's') /* -s */
+				{
+					SPARSE = 1;
+					continue;
+				}
+				if (*arg == 'z') /* -z */
+				{
+					DECOMPRESS = 1;
+					continue;
+				}
+				if (*arg == 'r') /* -r depth */
+				{
+					if (*(++arg) == 0) arg = *(++argv);
+					if (arg == NULL) usage(cmd, 1);
+					int n = strtonum(arg, 1, 4096, NULL);
+					if (n == 0) err(1, "error processing -r argument");
+					READ_AHEAD = n;
+					break;
+				}
+				if (*arg == 'j') /* -j jobs */
+				{
+					if (*(++arg) == 0) arg = *(++argv);
+					if (arg == NULL) usage(cmd, 1);
+					int n = strtonum(arg, 1, 1024, NULL);
+					if (n == 0) err(1, "error processing -j argument");
+					JOBS = n;
+					break;
+				}
+				if (*arg == 'B') /* -B manifest */
+				{
+					if (*(++arg) == 0) arg = *(++argv);
+					if (arg == NULL) usage(cmd, 1);
+
+					/* options before -B apply to every image, and nothing may follow it */
+					if ((NACTIONS != 0) || (argv[1] != NULL)) usage(cmd, 1);
+					exit(write_batch(cmd, arg));
+				}
+				if (*arg == 'c') /* -c */
+				{
+					CHECKSUM = 1;
+					VERBOSE = 1;
+					continue;
+				}
+				if (*arg == 'C') /* -C digestfile */
+				{
+					if (*(++arg) == 0) arg = *(++argv);
+					if (arg == NULL) usage(cmd, 1);
+					if ((DIGESTS = fopen(arg, "w")) == NULL) err(1, "error opening digest file %s", arg);
+					CHECKSUM = 1;
+					break;
+				}
+				if (*arg == 'i') /* -i indexfile */
+				{
+					if (*(++arg) == 0) arg = *(++argv);
+					if (arg == NULL) usage(cmd, 1);
+					INDEX.name = arg;
+					break;
+				}
 				if (*arg == 'f') /* -f filename */
 				{
 					if (*(++arg) == 0) arg = *(++argv);
 					if (arg == NULL) usage(cmd, 1);
-					if (VERBOSE) fprintf(stderr, "write from file %s", arg);
-					int n = open(arg, O_RDONLY);
-					if (n == -1) err(1, "error opening file %s", arg);
-					write_file(n);
-					n = close(n);
-					if (n == -1) err(1, "error closing file %s", arg);
+					add_action(ACTION_FILE, arg);
 					fflag = 1;
 					break;
 				}
@@ -121,39 +466,172 @@ int main(int argc, char **argv)
 		}
 
 		/* assume non-option arguments are file names */
-		if (VERBOSE) fprintf(stderr, "write from file %s", arg);
-		int fd = open(arg, O_RDONLY);
-		if (fd == -1) err(1, "error opening file %s", arg);
-		write_file(fd);
-		fd = close(fd);
-		if (fd == -1) err(1, "error closing file %s", arg);
+		add_action(ACTION_FILE, arg);
 		fflag = 1;
 	}
 
-	if (fflag == 0)
+	/* if command-line didn't specify any files, assume stdin */
+	if (fflag == 0) add_action(ACTION_STDIN, NULL);
+	add_action(ACTION_END, NULL);
+
+	if (APPEND != NULL) append_output(&OUTPUT, APPEND);
+
+	/* preallocated or parallel output needs the final size known before anything is written */
+	int flags = file_output(&OUTPUT);
+	off_t size = ((DIRECT) || (PARALLEL)) ? plan_tape() : -1;
+	if ((SPARSE) && (flags != -1)) OUTPUT.sparse = 1;
+	if ((DIRECT) && (flags != -1)) direct_output(&OUTPUT, size, flags);
+
+	/* checksums and the index need the image in order, and O_APPEND ignores write offsets */
+	if ((PARALLEL) && ((flags == -1) || (flags & O_APPEND) || (size == -1) || (CHECKSUM) || (INDEX.name != NULL)))
 	{
-		/* if command-line didn't specify any files, assume stdin */
-		if (VERBOSE) fprintf(stderr, "write from standard input");
-		write_file(STDIN_FILENO);
+		warnx("can't write files in parallel to this output (writing them in order)");
+		PARALLEL = 0;
 	}
 
-	/* write any remaining file marks */
-	while (FILE_MARK != 0)
+	struct digest image;
+	if (CHECKSUM)
 	{
-		if (VERBOSE) fprintf(stderr, "write file mark\n");
-		write_int32(STDOUT_FILENO, 0);
-		FILE_MARK--;
+		init_digest(&image);
+		OUTPUT.digest = &image;
 	}
 
-	if (TAPE_MARK != 0)
+	int i;
+	if (PARALLEL) write_parallel(size);
+	else for (i = 0; i < NACTIONS; i++) run_action(&ACTIONS[i]);
+	finish_output(&OUTPUT);
+	if (INDEX.name != NULL) write_index(&INDEX, &OUTPUT);
+
+	if (CHECKSUM)
 	{
-		if (VERBOSE) fprintf(stderr, "write end-of-tape mark\n");
-		write_int32(STDOUT_FILENO, -1);
+		VERBOSE = ACTIONS[NACTIONS - 1].verbose;
+		if (VERBOSE) fprintf(stderr, "image");
+		report_digest(&image, OUTPUT_NAME);
+		if ((DIGESTS != NULL) && (fclose(DIGESTS) == EOF)) err(1, "error closing digest file");
 	}
-
 	return 0;
 }
 
+/* a tape image listed in a manifest */
+struct image
+{
+	char *name;		/* image file name */
+	char **argv;		/* command line for the image */
+	FILE *log;		/* status and error messages */
+	pid_t pid;		/* process writing the image (0 once it has finished) */
+	int status;		/* exit status of that process */
+};
+
+/* write each tape image listed in a manifest, in separate processes running in parallel */
+int write_batch(char *cmd, char *manifest)
+{
+	struct image *img = NULL;
+	int nimg = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t ct;
+
+	FILE *f = fopen(manifest, "r");
+	if (f == NULL) err(1, "error opening manifest %s", manifest);
+
+	/* read the manifest, joining continued lines */
+	char *text = NULL;
+	size_t len = 0;
+	while ((ct = getline(&line, &line_size, f)) != -1)
+	{
+		if ((ct != 0) && (line[ct - 1] == '\n')) line[--ct] = 0;
+		if ((text = realloc(text, len + ct + 2)) == NULL) err(1, "unable to read manifest");
+		memcpy(text + len, line, ct);
+		len += ct;
+		if ((ct != 0) && (line[ct - 1] == '\\'))
+		{
+			text[len - 1] = ' ';
+			continue;
+		}
+		text[len] = 0;
+
+		/* split into words: image name, then its command line */
+		char **argv = NULL;
+		int argc = 0;
+		char *p, *word;
+		for (word = strtok_r(text, " \t", &p); word != NULL; word = strtok_r(NULL, " \t", &p))
+		{
+			if (*word == '#') break;
+			if ((argv = reallocarray(argv, argc + 2, sizeof(char *))) == NULL) err(1, "unable to read manifest");
+			argv[argc++] = word;
+		}
+		if (argc != 0)
+		{
+			if ((img = reallocarray(img, nimg + 1, sizeof(struct image))) == NULL) err(1, "unable to read manifest");
+			img[nimg].name = argv[0];
+			img[nimg].argv = argv;
+			argv[0] = cmd;
+			argv[argc] = NULL;
+			nimg++;
+		}
+		else
+		{
+			free(text);
+		}
+		text = NULL;
+		len = 0;
+	}
+	if (ferror(f)) err(1, "error reading manifest %s", manifest);
+	fclose(f);
+	free(line);
+
+	if (JOBS == 0) JOBS = sysconf(_SC_NPROCESSORS_ONLN);
+	if (JOBS < 1) JOBS = 1;
+
+	/* keep up to JOBS images in progress; report them in manifest order as they finish */
+	int next = 0, running = 0, failed = 0, shown = 0;
+	while ((next < nimg) || (running != 0))
+	{
+		if ((next < nimg) && (running < JOBS))
+		{
+			struct image *im = &img[next++];
+			if ((im->log = tmpfile()) == NULL) err(1, "unable to create log for %s", im->name);
+			fflush(stderr);
+			if ((im->pid = fork()) == -1) err(1, "unable to start writing %s", im->name);
+			if (im->pid == 0)
+			{
+				if (dup2(fileno(im->log), STDERR_FILENO) == -1) _exit(1);
+				int fd = open(im->name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+				if (fd == -1) err(1, "error opening image %s", im->name);
+				if (dup2(fd, STDOUT_FILENO) == -1) err(1, NULL);
+				close(fd);
+				OUTPUT_NAME = im->name;
+				exit(write_tape(im->argv));
+			}
+			running++;
+			continue;
+		}
+
+		int status, i;
+		pid_t pid = wait(&status);
+		if (pid == -1) err(1, NULL);
+		for (i = 0; (i < nimg) && (img[i].pid != pid); i++);
+		if (i == nimg) continue;
+		running--;
+		img[i].pid = 0;
+		img[i].status = status;
+
+		/* messages from parallel images are kept apart, each under the name of its image */
+		while ((shown < next) && (img[shown].pid == 0))
+		{
+			struct image *im = &img[shown++];
+			if ((VERBOSE) || (ftell(im->log) > 0)) fprintf(stderr, "%s:\n", im->name);
+			copy_log(im->log);
+			if (!WIFEXITED(im->status) || (WEXITSTATUS(im->status) != 0))
+			{
+				warnx("error writing image %s", im->name);
+				failed = 1;
+			}
+		}
+	}
+	return failed;
+}
+
 /* output usage message */
 void usage(const char *command, int status)
 {
@@ -162,53 +640,377 @@ void usage(const char *command, int status)
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, "  -h or -?      - display this message\n");
 	fprintf(stderr, "  -n recordsize - set the tape record size (default 512)\n");
+	fprintf(stderr, "  -r depth      - read up to 'depth' records ahead of output (default 0)\n");
 	fprintf(stderr, "  -f filename   - write the named file (-f may be omitted)\n");
 	fprintf(stderr, "  -m            - write a file mark after the next file\n");
 	fprintf(stderr, "  -M            - write a file mark before the next file\n");
 	fprintf(stderr, "  -t            - write an end-of-tape mark at the very end\n");
 	fprintf(stderr, "  -p            - pad the next file to fill its last record\n");
+	fprintf(stderr, "  -z            - decompress the next file if it is compressed\n");
+	fprintf(stderr, "  -B manifest   - write the tape images listed in 'manifest' (must be last)\n");
+	fprintf(stderr, "  -j jobs       - with -B or -P, write up to 'jobs' images or files at once (default: 1 per CPU)\n");
+	fprintf(stderr, "  -c            - display CRC32C (and SHA-256) of each file and the image (implies -v)\n");
+	fprintf(stderr, "  -C digestfile - write CRC32C (and SHA-256) of each file and the image to 'digestfile'\n");
+	fprintf(stderr, "  -i indexfile  - write an index of the tape files to 'indexfile'\n");
+	fprintf(stderr, "  -a image      - append to 'image' (replacing its end-of-tape mark) instead of writing to standard output\n");
+	fprintf(stderr, "  -D            - preallocate output file and bypass the buffer cache\n");
+	fprintf(stderr, "  -P            - write files in parallel at their planned offsets (regular-file output)\n");
+	fprintf(stderr, "  -s            - leave holes for all-zero records in a regular-file output\n");
 	fprintf(stderr, "  -v            - display status information\n");
 	fprintf(stderr, "  -             - write from standard input (default if no files given)\n");
 	fprintf(stderr, "  --            - don't write from standard input (suppress '-' default)\n");
+	fprintf(stderr, "a directory is written as a ustar archive of the tree below it.\n");
 	fprintf(stderr, "-m with no next file will write a file mark after the last file.\n");
 	fprintf(stderr, "repeat -m or -M options to write multiple file marks.\n");
+	fprintf(stderr, "each line of a manifest is an image file name followed by the options\n");
+	fprintf(stderr, "and files to write to it; a line ending in \\ continues on the next.\n");
 	exit(status);
 }
 
-/* convert file to SIMH virtual tape format */
-void write_file(int fd)
+/* add a step to the list, taking the options given since the previous file */
+void add_action(int type, char *name)
 {
-	int8_t *buf;
-	size_t ct, last_ct;
+	struct action *act;
+
+	if ((NACTIONS % 64) == 0)
+	{
+		if ((ACTIONS = reallocarray(ACTIONS, NACTIONS + 64, sizeof(struct action))) == NULL) err(1, "unable to initialize action list");
+	}
+	act = &ACTIONS[NACTIONS++];
+	memset(act, 0, sizeof(*act));
+	act->type = type;
+	act->name = name;
+	act->record_size = RECORD_SIZE;
+	act->read_ahead = READ_AHEAD;
+	act->verbose = VERBOSE;
+	if (type == ACTION_MARK) return;
+
+	act->marks = FILE_MARK;
+	act->pad = FILE_PAD;
+	act->decompress = DECOMPRESS;
+	FILE_MARK = 0;
+	FILE_PAD = 0;
+	DECOMPRESS = 0;
+}
+
+/* carry out one step, with the options that were in effect when it was given */
+void run_action(struct action *act)
+{
+	RECORD_SIZE = act->record_size;
+	READ_AHEAD = act->read_ahead;
+	VERBOSE = act->verbose;
+	FILE_MARK += act->marks;
+	if (act->pad) FILE_PAD = 1;
+	DECOMPRESS = act->decompress;
+
+	if (act->type == ACTION_STDIN)
+	{
+		if (VERBOSE) fprintf(stderr, "write from standard input");
+		write_file(STDIN_FILENO, "standard input");
+	}
+	else if (act->type == ACTION_FILE)
+	{
+		if (VERBOSE) fprintf(stderr, "write from file %s", act->name);
+		int fd = open(act->name, O_RDONLY);
+		if (fd == -1) err(1, "error opening file %s", act->name);
+		write_file(fd, act->name);
+		fd = close(fd);
+		if (fd == -1) err(1, "error closing file %s", act->name);
+	}
+	else if (act->type == ACTION_MARK)
+	{
+		write_mark(0);
+	}
+	else if (act->type == ACTION_END)
+	{
+		/* write any remaining file marks */
+		while (FILE_MARK != 0)
+		{
+			write_mark(0);
+			FILE_MARK--;
+		}
+
+		if (TAPE_MARK != 0) write_mark(-1);
+	}
+}
+
+/* find where each step's output will begin, and the size of the whole image (-1 if unknown) */
+off_t plan_tape(void)
+{
+	struct stat st;
+	off_t offset = 0;
+	int pad = 0;
+	int i;
+
+	for (i = 0; i < NACTIONS; i++)
+	{
+		struct action *act = &ACTIONS[i];
+		act->offset = offset;
+		if (act->pad) pad = 1;
+
+		if (act->type == ACTION_STDIN)
+		{
+			return -1;
+		}
+		else if (act->type == ACTION_FILE)
+		{
+			/* a compressed file's size isn't known until it has been decompressed */
+			if (act->decompress) return -1;
+			if ((stat(act->name, &st) == -1) || (!S_ISREG(st.st_mode))) return -1;
+
+			/* same padding rule as write_file(), where -p before an empty file carries over */
+			act->pad = pad;
+			off_t size = st.st_size;
+			if (size > 0)
+			{
+				if ((pad) && (size < (off_t)act->record_size)) size = act->record_size;
+				pad = 0;
+			}
+			offset += framed_size(size, act->record_size) + 4 * act->marks;
+		}
+		else if (act->type == ACTION_MARK)
+		{
+			offset += 4;
+		}
+		else if (act->type == ACTION_END)
+		{
+			offset += 4 * act->marks;
+			if (TAPE_MARK != 0) offset += 4;
+		}
+	}
+	return offset;
+}
+
+/* size of a file's data once split into records and framed */
+off_t framed_size(off_t size, size_t record_size)
+{
+	off_t n = size / record_size;
+	off_t ct = size % record_size;
+
+	size = n * (record_size + (record_size & 1) + 8);
+	if (ct != 0) size += ct + (ct & 1) + 8;
+	return size;
+}
+
+/* write each file in its own process, at the offset planned for it (marks are written here) */
+void write_parallel(off_t size)
+{
+	int next = 0;		/* next step to consider starting */
+	int running = 0;	/* number of processes running */
+	int i = 0;		/* next step to report (and to write, if a mark) */
+
+	if (JOBS == 0) JOBS = sysconf(_SC_NPROCESSORS_ONLN);
+	if (JOBS < 1) JOBS = 1;
+
+	/* the file is made full size first, so every process can write its part in place */
+	OUTPUT.positional = 1;
+	if (OUTPUT.direct) set_direct(&OUTPUT, 0);
+	if ((OUTPUT.base + size > OUTPUT.keep) && (OUTPUT.base + size > OUTPUT.end))
+	{
+		if (ftruncate(OUTPUT.fd, OUTPUT.base + size) == -1) err(1, "unable to extend output");
+		OUTPUT.end = OUTPUT.base + size;
+	}
+
+	while (i < NACTIONS)
+	{
+		struct action *act;
+		while ((running < JOBS) && (next < NACTIONS))
+		{
+			act = &ACTIONS[next++];
+			if (act->type != ACTION_FILE) continue;
+
+			if ((act->log = tmpfile()) == NULL) err(1, "unable to create log for %s", act->name);
+			fflush(stderr);
+			if ((act->pid = fork()) == -1) err(1, "unable to start writing %s", act->name);
+			if (act->pid == 0)
+			{
+				/* the file must fill exactly the space planned for it, or it would overwrite or leave a gap before the next */
+				if (dup2(fileno(act->log), STDERR_FILENO) == -1) _exit(1);
+				OUTPUT.offset = act->offset;
+				OUTPUT.at = OUTPUT.base + act->offset;
+				OUTPUT.limit = act[1].offset;
+				OUTPUT.limit_name = act->name;
+				run_action(act);
+				flush_output(&OUTPUT);
+				if (OUTPUT.offset != OUTPUT.limit) errx(1, "%s shrank after the image was planned", act->name);
+				exit(0);
+			}
+			running++;
+		}
+
+		/* report steps in order, so messages come out as if written sequentially */
+		act = &ACTIONS[i];
+		if (act->type != ACTION_FILE)
+		{
+			OUTPUT.offset = act->offset;
+			OUTPUT.at = OUTPUT.base + act->offset;
+			run_action(act);
+			flush_output(&OUTPUT);
+			i++;
+			continue;
+		}
+		if (!act->done)
+		{
+			int status, j;
+			pid_t pid = wait(&status);
+			if (pid == -1) err(1, NULL);
+			for (j = 0; (j < NACTIONS) && ((ACTIONS[j].type != ACTION_FILE) || (ACTIONS[j].pid != pid)); j++);
+			if (j == NACTIONS) continue;
+			ACTIONS[j].status = status;
+			ACTIONS[j].done = 1;
+			running--;
+			continue;
+		}
+		copy_log(act->log);
+		if (!WIFEXITED(act->status) || (WEXITSTATUS(act->status) != 0)) exit(1);
+		i++;
+	}
+
+	OUTPUT.positional = 0;
+	OUTPUT.offset = size;
+	if (lseek(OUTPUT.fd, OUTPUT.base + size, SEEK_SET) == -1) err(1, "unable to seek output");
+}
+
+/* copy a process's messages to standard error */
+void copy_log(FILE *log)
+{
+	int c;
 
-	if ((buf = malloc(RECORD_SIZE)) == NULL) err(1, "unable to initialize buffer");
+	rewind(log);
+	while ((c = getc(log)) != EOF) putc(c, stderr);
+	fclose(log);
+}
 
+/* write the records of a mapped file, returning the number written */
+int write_mapped(int fd, const char *name, int8_t *buf, size_t size, struct digest *digest, size_t *last_ct)
+{
+	struct stat st;
+	size_t ct, p = 0, check = 0;
 	int n = 0;
-	while ((ct = read_buffer(fd, buf, RECORD_SIZE)) > 0)
+
+	while ((ct = size - p) > 0)
 	{
+		if (p >= check)
+		{
+			/* a file that shrinks ends early, as it would have if read; write out what refers to it first */
+			flush_output(&OUTPUT);
+			if (fstat(fd, &st) == -1) err(1, "error reading %s", name);
+			if (st.st_size < (off_t)size)
+			{
+				warnx("%s: file shrank while being written", name);
+				size = (st.st_size > (off_t)p) ? (size_t)st.st_size : p;
+				if ((ct = size - p) == 0) break;
+			}
+			check = p + MAP_CHECK;
+		}
+		if (ct > RECORD_SIZE) ct = RECORD_SIZE;
+		size_t sz = ct;
+		if (CHECKSUM) update_digest(digest, buf + p, ct);
+
 		/* last record may be short */
 		if (FILE_PAD != 0)
 		{
-			while (ct < RECORD_SIZE) buf[ct++] = 0;
+			if (sz < RECORD_SIZE) sz = RECORD_SIZE;
 			FILE_PAD = 0;
 		}
 
-		/* write record size */
-		write_int32(STDOUT_FILENO, ct);
+		index_record(&INDEX, OUTPUT.offset, sz);
+		put_int32(&OUTPUT, sz);
+		if ((SPARSE) && (is_zero(buf + p, ct))) put_hole(&OUTPUT, ct);
+		else put_mapped(&OUTPUT, buf + p, ct);
+		if (sz != ct) put_hole(&OUTPUT, sz - ct);
+		if ((sz & 1) != 0) put_int8(&OUTPUT, 0);
+		put_int32(&OUTPUT, sz);
+
+		p += ct;
+		n++;
+		*last_ct = sz;
+	}
+	return n;
+}
+
+/* a mapped file was truncated while its pages were being read */
+void mapped_fault(int sig)
+{
+	(void)sig;
+	siglongjmp(MAPPED_FAULT, 1);
+}
+
+/* convert file to SIMH virtual tape format */
+void write_file(int fd, const char *name)
+{
+	struct stat st;
+	struct digest digest;
+	int8_t *buf;
+	size_t ct, last_ct = 0;
 
-		/* write record */
-		write_buffer(STDOUT_FILENO, buf, ct);
+	if (CHECKSUM) init_digest(&digest);
 
-		/* add pad byte if needed */
-		if ((ct & 1) != 0) write_int8(STDOUT_FILENO, 0);
+	int n = 0;
+	if ((READ_AHEAD == 0) && (DECOMPRESS == 0) && (fstat(fd, &st) == 0) && (S_ISREG(st.st_mode)) && (st.st_size > 0) && ((uint64_t)st.st_size <= SIZE_MAX) &&
+	    ((buf = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED))
+	{
+		/* regular files are mapped, and records are written straight from the mapping */
+		posix_madvise(buf, st.st_size, POSIX_MADV_SEQUENTIAL);
 
-		/* write record size */
-		write_int32(STDOUT_FILENO, ct);
+		/* touching pages past the end of a file that was truncated raises SIGBUS */
+		struct sigaction sa, old_sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = mapped_fault;
+		sigemptyset(&sa.sa_mask);
+		if (sigsetjmp(MAPPED_FAULT, 1) != 0) errx(1, "%s: file shrank while being written", name);
+		if (sigaction(SIGBUS, &sa, &old_sa) == -1) err(1, NULL);
+		n = write_mapped(fd, name, buf, st.st_size, &digest, &last_ct);
 
-		n++;
-		last_ct = ct;
+		/* pending output refers to the mapping, so it must be written before unmapping */
+		flush_output(&OUTPUT);
+		if (sigaction(SIGBUS, &old_sa, NULL) == -1) err(1, NULL);
+		if (munmap(buf, st.st_size) == -1) err(1, NULL);
+	}
+	else
+	{
+		struct input in;
+		struct readahead ra;
+		open_input(&in, fd, name, DECOMPRESS);
+
+		/* archiving a directory tree is slow enough to be worth overlapping with output */
+		int depth = READ_AHEAD;
+		if ((in.format == INPUT_TAR) && (depth < TAR_READ_AHEAD)) depth = TAR_READ_AHEAD;
+		start_reader(&ra, &in, RECORD_SIZE, depth);
+
+		while ((buf = next_record(&ra, &ct)) != NULL)
+		{
+			if (CHECKSUM) update_digest(&digest, buf, ct);
+
+			/* last record may be short */
+			if (FILE_PAD != 0)
+			{
+				while (ct < RECORD_SIZE) buf[ct++] = 0;
+				FILE_PAD = 0;
+			}
+
+			/* write record size */
+			index_record(&INDEX, OUTPUT.offset, ct);
+			put_int32(&OUTPUT, ct);
+
+			/* write record */
+			if ((SPARSE) && (is_zero(buf, ct))) put_hole(&OUTPUT, ct);
+			else put_buffer(&OUTPUT, buf, ct);
+
+			/* add pad byte if needed */
+			if ((ct & 1) != 0) put_int8(&OUTPUT, 0);
+
+			/* write record size */
+			put_int32(&OUTPUT, ct);
+
+			n++;
+			last_ct = ct;
+			done_record(&ra);
+		}
+		stop_reader(&ra);
+		close_input(&in);
 	}
-	free(buf);
+	DECOMPRESS = 0;
 
 	if (VERBOSE)
 	{
@@ -229,56 +1031,1141 @@ void write_file(int fd)
 			fprintf(stderr, " (%d %zu-byte records, 1 %zu-byte record)\n", n - 1, RECORD_SIZE, last_ct);
 		}
 	}
+	if (CHECKSUM) report_digest(&digest, name);
 
 	while (FILE_MARK != 0)
 	{
-		if (VERBOSE) fprintf(stderr, "write file mark\n");
-		write_int32(STDOUT_FILENO, 0);
+		write_mark(0);
 		FILE_MARK--;
 	}
 }
 
-/* read a full buffer (even from a pipe) */
-size_t read_buffer(int fd, void *buf, size_t nbytes)
+/* write a file mark (0) or end-of-tape mark (-1) */
+void write_mark(int mark)
 {
-	size_t p = 0;
-	while (p < nbytes)
-	{
-		ssize_t ct = read(fd, buf + p, nbytes - p);
-		if (ct == -1) err(1, NULL);
-		if (ct == 0) break;
-		p += ct;
-	}
-	return p;
+	if (VERBOSE) fprintf(stderr, (mark == 0) ? "write file mark\n" : "write end-of-tape mark\n");
+	index_mark(&INDEX, OUTPUT.offset, mark);
+	put_int32(&OUTPUT, mark);
 }
 
-/* write a buffer */
-void write_buffer(int fd, const void *buf, size_t nbytes)
+/* prepare to read a file, recognizing gzip and xz data by their magic numbers if asked to */
+void open_input(struct input *in, int fd, const char *name, int decompress)
 {
-	size_t p = 0;
-	while (p < nbytes)
+	struct stat st;
+
+	memset(in, 0, sizeof(*in));
+	in->fd = fd;
+	in->format = INPUT_PLAIN;
+
+	/* a directory is read as a tar archive of its contents */
+	if ((fstat(fd, &st) == 0) && (S_ISDIR(st.st_mode)))
 	{
-		ssize_t ct = write(fd, buf + p, nbytes - p);
-		if (ct == -1) err(1, NULL);
-		p += ct;
+		in->format = INPUT_TAR;
+		in->tar = open_tar(name, RECORD_SIZE);
+		return;
+	}
+	if (decompress == 0) return;
+
+	if ((in->buf = malloc(INPUT_SIZE)) == NULL) err(1, "unable to initialize input buffer");
+	in->len = read_buffer(fd, in->buf, 6);
+	if ((in->len >= 2) && (in->buf[0] == 0x1f) && (in->buf[1] == 0x8b))
+	{
+#ifdef HAVE_ZLIB
+		in->format = INPUT_GZIP;
+		in->z.next_in = in->buf;
+		in->z.avail_in = in->len;
+		if (inflateInit2(&in->z, 15 + 16) != Z_OK) errx(1, "unable to initialize gzip decompression");
+#else
+		errx(1, "gzip decompression not supported (rebuild with -DHAVE_ZLIB)");
+#endif
+	}
+	else if ((in->len == 6) && (memcmp(in->buf, "\xfd" "7zXZ\0", 6) == 0))
+	{
+#ifdef HAVE_LZMA
+		in->format = INPUT_XZ;
+		in->x = (lzma_stream)LZMA_STREAM_INIT;
+		in->x.next_in = in->buf;
+		in->x.avail_in = in->len;
+		if (lzma_stream_decoder(&in->x, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) errx(1, "unable to initialize xz decompression");
+#else
+		errx(1, "xz decompression not supported (rebuild with -DHAVE_LZMA)");
+#endif
 	}
 }
 
-/* write an 8-bit byte */
-void write_int8(int fd, int8_t value)
+/* read a full buffer of (decompressed) input */
+size_t read_input(struct input *in, void *buf, size_t nbytes)
 {
-	write_buffer(fd, &value, 1);
+	if (in->format == INPUT_GZIP) return inflate_input(in, buf, nbytes);
+	if (in->format == INPUT_XZ) return unxz_input(in, buf, nbytes);
+	if (in->format == INPUT_TAR) return read_tar(in->tar, buf, nbytes);
+
+	/* bytes examined by open_input() come first */
+	size_t p = in->len - in->pos;
+	if (p > nbytes) p = nbytes;
+	memcpy(buf, in->buf + in->pos, p);
+	in->pos += p;
+	return p + read_buffer(in->fd, buf + p, nbytes - p);
 }
 
-/* write a 32-bit integer in little-endian format */
-void write_int32(int fd, int value)
+/* read a full buffer of gzip-decompressed input (concatenated gzip members are joined) */
+size_t inflate_input(struct input *in, void *buf, size_t nbytes)
 {
-	int i;
+#ifdef HAVE_ZLIB
+	in->z.next_out = buf;
+	in->z.avail_out = nbytes;
+	while ((in->z.avail_out != 0) && (in->done == 0))
+	{
+		if ((in->z.avail_in == 0) && (in->eof == 0))
+		{
+			fill_input(in);
+			in->z.next_in = in->buf;
+			in->z.avail_in = in->len;
+		}
+		int r = inflate(&in->z, Z_NO_FLUSH);
+		if (r == Z_STREAM_END)
+		{
+			/* another gzip member may follow */
+			if ((in->z.avail_in == 0) && (in->eof == 0))
+			{
+				fill_input(in);
+				in->z.next_in = in->buf;
+				in->z.avail_in = in->len;
+			}
+			if (in->z.avail_in == 0)
+			{
+				in->done = 1;
+			}
+			else if (in->z.next_in[0] != 0x1f)
+			{
+				warnx("trailing garbage after gzip data ignored");
+				in->done = 1;
+			}
+			else
+			{
+				inflateReset(&in->z);
+			}
+		}
+		else if ((r == Z_BUF_ERROR) && (in->eof != 0))
+		{
+			errx(1, "unexpected end of gzip data");
+		}
+		else if ((r != Z_OK) && (r != Z_BUF_ERROR))
+		{
+			errx(1, "gzip decompression error: %s", (in->z.msg) ? in->z.msg : "unknown error");
+		}
+	}
+	return nbytes - in->z.avail_out;
+#else
+	(void)in;
+	(void)buf;
+	(void)nbytes;
+	return 0;
+#endif
+}
+
+/* read a full buffer of xz-decompressed input */
+size_t unxz_input(struct input *in, void *buf, size_t nbytes)
+{
+#ifdef HAVE_LZMA
+	in->x.next_out = buf;
+	in->x.avail_out = nbytes;
+	while ((in->x.avail_out != 0) && (in->done == 0))
+	{
+		if ((in->x.avail_in == 0) && (in->eof == 0))
+		{
+			fill_input(in);
+			in->x.next_in = in->buf;
+			in->x.avail_in = in->len;
+		}
+		lzma_ret r = lzma_code(&in->x, (in->eof) ? LZMA_FINISH : LZMA_RUN);
+		if (r == LZMA_STREAM_END) in->done = 1;
+		else if (r != LZMA_OK) errx(1, "xz decompression error %d", r);
+	}
+	return nbytes - in->x.avail_out;
+#else
+	(void)in;
+	(void)buf;
+	(void)nbytes;
+	return 0;
+#endif
+}
+
+/* refill the input buffer with compressed data */
+void fill_input(struct input *in)
+{
+	ssize_t ct = read(in->fd, in->buf, INPUT_SIZE);
+	if (ct == -1) err(1, NULL);
+	if (ct == 0) in->eof = 1;
+	in->len = ct;
+}
+
+/* release decompressor state */
+void close_input(struct input *in)
+{
+#ifdef HAVE_ZLIB
+	if (in->format == INPUT_GZIP) inflateEnd(&in->z);
+#endif
+#ifdef HAVE_LZMA
+	if (in->format == INPUT_XZ) lzma_end(&in->x);
+#endif
+	if (in->format == INPUT_TAR) close_tar(in->tar);
+	free(in->buf);
+}
+
+/* start a tar archive of a directory tree */
+struct tar *open_tar(const char *name, size_t record_size)
+{
+	struct tar *t;
+	char *paths[2] = { (char *)name, NULL };
+
+	if ((t = calloc(1, sizeof(struct tar))) == NULL) err(1, "unable to initialize tar archive");
+	if ((t->fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, tar_compare)) == NULL) err(1, "error reading directory %s", name);
+	t->record_size = record_size;
+	t->hdr_pos = sizeof(t->hdr);
+	t->fd = -1;
+	return t;
+}
+
+/* read a full buffer of tar archive */
+size_t read_tar(struct tar *t, uint8_t *buf, size_t nbytes)
+{
+	size_t p = 0;
+
+	while (p < nbytes)
+	{
+		size_t ct = nbytes - p;
+		if (t->hdr_pos < sizeof(t->hdr))
+		{
+			if (ct > sizeof(t->hdr) - t->hdr_pos) ct = sizeof(t->hdr) - t->hdr_pos;
+			memcpy(buf + p, t->hdr + t->hdr_pos, ct);
+			t->hdr_pos += ct;
+		}
+		else if (t->data != 0)
+		{
+			if ((off_t)ct > t->data) ct = t->data;
+			ssize_t n = (t->fd == -1) ? 0 : read(t->fd, buf + p, ct);
+			if (n == -1) err(1, "error reading %s", t->path);
+			if (n == 0)
+			{
+				/* file shrank after its header was written, so make up the difference */
+				if (t->fd != -1) warnx("%s: file shrank while being archived (padded with zeros)", t->path);
+				memset(buf + p, 0, ct);
+				n = ct;
+				if (t->fd != -1) close(t->fd);
+				t->fd = -1;
+			}
+			ct = n;
+			t->data -= ct;
+			if ((t->data == 0) && (t->fd != -1))
+			{
+				close(t->fd);
+				t->fd = -1;
+			}
+		}
+		else if (t->zeros != 0)
+		{
+			if (ct > t->zeros) ct = t->zeros;
+			memset(buf + p, 0, ct);
+			t->zeros -= ct;
+		}
+		else if (!t->done)
+		{
+			next_tar_entry(t);
+			continue;
+		}
+		else
+		{
+			break;
+		}
+		p += ct;
+		t->total += ct;
+	}
+	return p;
+}
+
+/* set up the header (and data) of the next file in the tree, or the end of the archive */
+void next_tar_entry(struct tar *t)
+{
+	FTSENT *e;
+
+	errno = 0;
+	while ((e = fts_read(t->fts)) != NULL)
+	{
+		if (e->fts_info == FTS_DP) continue;
+		if ((e->fts_info == FTS_DNR) || (e->fts_info == FTS_ERR) || (e->fts_info == FTS_NS))
+		{
+			warnx("%s: %s", e->fts_path, strerror(e->fts_errno));
+			continue;
+		}
+		if (e->fts_info == FTS_DC)
+		{
+			warnx("%s: directory cycle, not archived", e->fts_path);
+			continue;
+		}
+		if (tar_header(t, e)) return;
+	}
+	if (errno != 0) err(1, "error reading directory");
+
+	/* two zero blocks end the archive, which is then padded to a whole record */
+	t->zeros = 1024;
+	if (t->record_size != 0) t->zeros += (t->record_size - (t->total + 1024) % t->record_size) % t->record_size;
+	t->done = 1;
+}
+
+/* build a ustar header for a file (returns 0 if the file can't be archived) */
+int tar_header(struct tar *t, FTSENT *e)
+{
+	struct stat *st = e->fts_statp;
+	uint8_t *hdr = t->hdr;
+	static uid_t uid = -1;
+	static gid_t gid = -1;
+	static char uname[32], gname[32];
+	char *path = e->fts_path;
+	char name[PATH_MAX + 2];
+	char link[PATH_MAX + 1];
+	int type, i;
+	int first_link = 0;	/* flag: first link seen to a file with several */
+
+	/* names are stored relative (as tar does), with a / after directory names */
+	while (*path == '/') path++;
+	if (*path == 0) path = ".";
+	size_t len = strlen(path);
+	if (len > PATH_MAX) len = PATH_MAX;
+	memcpy(name, path, len);
+	if ((S_ISDIR(st->st_mode)) && (name[len - 1] != '/')) name[len++] = '/';
+	name[len] = 0;
+
+	memset(hdr, 0, sizeof(t->hdr));
+	off_t size = 0;
+	link[0] = 0;
+	if (S_ISREG(st->st_mode))
+	{
+		type = '0';
+		size = st->st_size;
+		if (st->st_nlink > 1)
+		{
+			/* later links to the same file are archived as hard links */
+			for (i = 0; i < t->nlinks; i++)
+			{
+				if ((t->links[i].dev == st->st_dev) && (t->links[i].ino == st->st_ino)) break;
+			}
+			if ((i < t->nlinks) && (strlen(t->links[i].name) <= 100))
+			{
+				type = '1';
+				size = 0;
+				strlcpy(link, t->links[i].name, sizeof(link));
+			}
+			else if (i == t->nlinks)
+			{
+				first_link = 1;
+			}
+		}
+	}
+	else if (S_ISDIR(st->st_mode))
+	{
+		type = '5';
+	}
+	else if (S_ISLNK(st->st_mode))
+	{
+		type = '2';
+		ssize_t ct = readlink(e->fts_accpath, link, sizeof(link) - 1);
+		if (ct == -1)
+		{
+			warn("%s", e->fts_path);
+			return 0;
+		}
+		link[ct] = 0;
+	}
+	else if (S_ISCHR(st->st_mode))
+	{
+		type = '3';
+	}
+	else if (S_ISBLK(st->st_mode))
+	{
+		type = '4';
+	}
+	else if (S_ISFIFO(st->st_mode))
+	{
+		type = '6';
+	}
+	else
+	{
+		warnx("%s: file type not supported by tar, not archived", e->fts_path);
+		return 0;
+	}
+	if (strlen(link) > 100)
+	{
+		warnx("%s: link name too long, not archived", e->fts_path);
+		return 0;
+	}
+
+	/* names longer than 100 characters are split at a / into prefix and name */
+	if (len <= 100)
+	{
+		memcpy(hdr, name, len);
+	}
+	else
+	{
+		for (i = len - 2; i >= 0; i--)
+		{
+			if ((name[i] == '/') && (i <= 155) && (len - i - 1 <= 100)) break;
+			if (len - i - 1 > 100) i = -1;
+		}
+		if (i < 0)
+		{
+			warnx("%s: name too long, not archived", e->fts_path);
+			return 0;
+		}
+		memcpy(hdr + 345, name, i);
+		memcpy(hdr, name + i + 1, len - i - 1);
+	}
+
+	if (type == '0')
+	{
+		if ((t->fd = open(e->fts_accpath, O_RDONLY)) == -1)
+		{
+			warn("%s", e->fts_path);
+			return 0;
+		}
+		t->path = e->fts_path;
+	}
+
+	if (st->st_uid != uid)
+	{
+		struct passwd *pw = getpwuid(uid = st->st_uid);
+		strlcpy(uname, (pw != NULL) ? pw->pw_name : "", sizeof(uname));
+	}
+	if (st->st_gid != gid)
+	{
+		struct group *gr = getgrgid(gid = st->st_gid);
+		strlcpy(gname, (gr != NULL) ? gr->gr_name : "", sizeof(gname));
+	}
+
+	tar_number(hdr + 100, 8, st->st_mode & 07777);
+	tar_number(hdr + 108, 8, st->st_uid);
+	tar_number(hdr + 116, 8, st->st_gid);
+	tar_number(hdr + 124, 12, size);
+	tar_number(hdr + 136, 12, st->st_mtime);
+	hdr[156] = type;
+	memcpy(hdr + 157, link, strlen(link));
+	memcpy(hdr + 257, "ustar", 6);
+	memcpy(hdr + 263, "00", 2);
+	memcpy(hdr + 265, uname, strlen(uname));
+	memcpy(hdr + 297, gname, strlen(gname));
+	if ((type == '3') || (type == '4'))
+	{
+		tar_number(hdr + 329, 8, major(st->st_rdev));
+		tar_number(hdr + 337, 8, minor(st->st_rdev));
+	}
+
+	/* checksum is computed with the checksum field set to spaces */
+	unsigned int sum = 0;
+	memset(hdr + 148, ' ', 8);
+	for (i = 0; i < 512; i++) sum += hdr[i];
+	snprintf((char *)hdr + 148, 8, "%06o", sum);
+
+	/* only a file that made it into the archive can be the target of later hard links */
+	if (first_link)
+	{
+		if ((t->links = reallocarray(t->links, t->nlinks + 1, sizeof(struct tar_link))) == NULL) err(1, "unable to resize link table");
+		t->links[t->nlinks].dev = st->st_dev;
+		t->links[t->nlinks].ino = st->st_ino;
+		if ((t->links[t->nlinks].name = strdup(name)) == NULL) err(1, "unable to resize link table");
+		t->nlinks++;
+	}
+
+	t->hdr_pos = 0;
+	t->data = size;
+	t->zeros = (512 - size % 512) % 512;
+	return 1;
+}
+
+/* store a number in a tar header field: octal, or base-256 if too large for octal */
+void tar_number(uint8_t *field, size_t len, uint64_t value)
+{
+	if ((len - 1) * 3 >= 64 || (value >> ((len - 1) * 3)) == 0)
+	{
+		snprintf((char *)field, len, "%0*llo", (int)len - 1, (unsigned long long)value);
+		return;
+	}
+	memset(field, 0, len);
+	field[0] = 0x80;
+	while (--len > 0)
+	{
+		field[len] = value & 0xff;
+		value >>= 8;
+	}
+}
+
+/* archive directory entries in name order, so the same tree always gives the same archive */
+int tar_compare(const FTSENT **a, const FTSENT **b)
+{
+	return strcmp((*a)->fts_name, (*b)->fts_name);
+}
+
+/* finish a tar archive */
+void close_tar(struct tar *t)
+{
+	int i;
+
+	if (t->fd != -1) close(t->fd);
+	fts_close(t->fts);
+	for (i = 0; i < t->nlinks; i++) free(t->links[i].name);
+	free(t->links);
+	free(t);
+}
+
+/* set up record buffers, and start a reader thread if reading ahead */
+void start_reader(struct readahead *ra, struct input *in, size_t size, int depth)
+{
+	ra->in = in;
+	ra->size = size;
+	ra->depth = depth;
+	ra->head = ra->tail = ra->count = 0;
+	if ((ra->buf = malloc(size * (depth + 1))) == NULL) err(1, "unable to initialize buffer");
+	if ((ra->len = calloc(depth + 1, sizeof(size_t))) == NULL) err(1, "unable to initialize buffer");
+	if (depth == 0) return;
+
+	if ((errno = pthread_mutex_init(&ra->lock, NULL)) != 0) err(1, "unable to initialize read-ahead");
+	if ((errno = pthread_cond_init(&ra->cond, NULL)) != 0) err(1, "unable to initialize read-ahead");
+	if ((errno = pthread_create(&ra->thread, NULL, reader_thread, ra)) != 0) err(1, "unable to start read-ahead");
+}
+
+/* fill record buffers until end of input, staying at most 'depth' records ahead */
+void *reader_thread(void *arg)
+{
+	struct readahead *ra = arg;
+	size_t ct;
+
+	do
+	{
+		/* wait while the writer is already "depth" records behind */
+		pthread_mutex_lock(&ra->lock);
+		while (ra->count == ra->depth) pthread_cond_wait(&ra->cond, &ra->lock);
+		pthread_mutex_unlock(&ra->lock);
+
+		ct = read_input(ra->in, ra->buf + ra->head * ra->size, ra->size);
+
+		pthread_mutex_lock(&ra->lock);
+		ra->len[ra->head] = ct;
+		ra->head = (ra->head + 1) % (ra->depth + 1);
+		ra->count++;
+		pthread_cond_broadcast(&ra->cond);
+		pthread_mutex_unlock(&ra->lock);
+	} while (ct > 0);
+
+	return NULL;
+}
+
+/* get the next record, or NULL at end of input */
+int8_t *next_record(struct readahead *ra, size_t *ct)
+{
+	int8_t *buf = ra->buf + ra->tail * ra->size;
+
+	if (ra->depth == 0)
+	{
+		*ct = read_input(ra->in, buf, ra->size);
+	}
+	else
+	{
+		pthread_mutex_lock(&ra->lock);
+		while (ra->count == 0) pthread_cond_wait(&ra->cond, &ra->lock);
+		pthread_mutex_unlock(&ra->lock);
+		*ct = ra->len[ra->tail];
+	}
+	return (*ct == 0) ? NULL : buf;
+}
+
+/* release the record returned by next_record() so its buffer can be refilled */
+void done_record(struct readahead *ra)
+{
+	if (ra->depth == 0) return;
+
+	pthread_mutex_lock(&ra->lock);
+	ra->tail = (ra->tail + 1) % (ra->depth + 1);
+	ra->count--;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+}
+
+/* wait for the reader thread (which stops at end of input) and free record buffers */
+void stop_reader(struct readahead *ra)
+{
+	if (ra->depth != 0)
+	{
+		if ((errno = pthread_join(ra->thread, NULL)) != 0) err(1, "unable to stop read-ahead");
+		pthread_cond_destroy(&ra->cond);
+		pthread_mutex_destroy(&ra->lock);
+	}
+	free(ra->len);
+	free(ra->buf);
+}
+
+/* start computing checksums */
+void init_digest(struct digest *d)
+{
+	d->crc = 0;
+#ifdef HAVE_SHA2
+	SHA256Init(&d->sha);
+#endif
+}
+
+/* add bytes to checksums */
+void update_digest(struct digest *d, const void *buf, size_t nbytes)
+{
+	d->crc = crc32c(d->crc, buf, nbytes);
+#ifdef HAVE_SHA2
+	SHA256Update(&d->sha, buf, nbytes);
+#endif
+}
+
+/* finish computing checksums, and display them and/or write them to the digest file */
+void report_digest(struct digest *d, const char *name)
+{
+#ifdef HAVE_SHA2
+	uint8_t sha[SHA256_DIGEST_LENGTH];
+	char hex[2 * SHA256_DIGEST_LENGTH + 1];
+	int i;
+
+	SHA256Final(sha, &d->sha);
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++) snprintf(hex + 2 * i, 3, "%02x", sha[i]);
+
+	if (VERBOSE) fprintf(stderr, " crc32c %08x sha256 %s\n", d->crc, hex);
+	if (DIGESTS != NULL)
+	{
+		fprintf(DIGESTS, "CRC32C (%s) = %08x\n", name, d->crc);
+		fprintf(DIGESTS, "SHA256 (%s) = %s\n", name, hex);
+	}
+#else
+	/* SHA-256 needs sha2.h (libmd or the BSD libc); CRC32C is built in */
+	if (VERBOSE) fprintf(stderr, " crc32c %08x\n", d->crc);
+	if (DIGESTS != NULL) fprintf(DIGESTS, "CRC32C (%s) = %08x\n", name, d->crc);
+#endif
+}
+
+#ifdef HAVE_SSE42_CRC32C
+/* CRC32C using the SSE 4.2 crc32 instruction */
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t *buf, size_t nbytes)
+{
+	while ((nbytes != 0) && (((uintptr_t)buf & 7) != 0))
+	{
+		crc = _mm_crc32_u8(crc, *buf++);
+		nbytes--;
+	}
+	uint64_t crc64 = crc;
+	while (nbytes >= 8)
+	{
+		crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)buf);
+		buf += 8;
+		nbytes -= 8;
+	}
+	crc = crc64;
+	while (nbytes-- != 0) crc = _mm_crc32_u8(crc, *buf++);
+	return crc;
+}
+#endif
+
+/* update a CRC32C (Castagnoli) checksum, using CRC instructions if the processor has them */
+uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t nbytes)
+{
+	static uint32_t table[8][256];
+	static int init = 0;
+	int i, j;
+
+	crc = ~crc;
+#ifdef HAVE_SSE42_CRC32C
+	if (__builtin_cpu_supports("sse4.2")) return ~crc32c_sse42(crc, buf, nbytes);
+#elif defined(__ARM_FEATURE_CRC32)
+	while (nbytes >= 8)
+	{
+		crc = __crc32cd(crc, *(const uint64_t *)buf);
+		buf += 8;
+		nbytes -= 8;
+	}
+	while (nbytes-- != 0) crc = __crc32cb(crc, *buf++);
+	return ~crc;
+#endif
+
+	/* otherwise, slicing-by-8 tables */
+	if (!init)
+	{
+		for (i = 0; i < 256; i++)
+		{
+			uint32_t c = i;
+			for (j = 0; j < 8; j++) c = (c >> 1) ^ ((c & 1) ? 0x82F63B78 : 0);
+			table[0][i] = c;
+		}
+		for (i = 0; i < 256; i++)
+		{
+			for (j = 1; j < 8; j++) table[j][i] = (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 0xff];
+		}
+		init = 1;
+	}
+	while (nbytes >= 8)
+	{
+		uint32_t lo = crc ^ (buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24));
+		crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+		      table[3][buf[4]] ^ table[2][buf[5]] ^ table[1][buf[6]] ^ table[0][buf[7]];
+		buf += 8;
+		nbytes -= 8;
+	}
+	while (nbytes-- != 0) crc = (crc >> 8) ^ table[0][(crc ^ *buf++) & 0xff];
+	return ~crc;
+}
+
+/* read a full buffer (even from a pipe) */
+size_t read_buffer(int fd, void *buf, size_t nbytes)
+{
+	size_t p = 0;
+	while (p < nbytes)
+	{
+		ssize_t ct = read(fd, buf + p, nbytes - p);
+		if (ct == -1) err(1, NULL);
+		if (ct == 0) break;
+		p += ct;
+	}
+	return p;
+}
+
+/* write a buffer */
+void write_buffer(int fd, const void *buf, size_t nbytes)
+{
+	size_t p = 0;
+	while (p < nbytes)
+	{
+		ssize_t ct = write(fd, buf + p, nbytes - p);
+		if (ct == -1) err(1, NULL);
+		p += ct;
+	}
+}
+
+/* make sure the output buffer and slice list exist */
+void init_output(struct output *out)
+{
+	if ((out->buf == NULL) && ((out->buf = malloc(out->size)) == NULL)) err(1, "unable to initialize output buffer");
+	if ((out->iov == NULL) && ((out->iov = calloc(OUTPUT_IOV, sizeof(struct iovec))) == NULL)) err(1, "unable to initialize output buffer");
+}
+
+/* append a copy of a buffer to the output, writing it out whenever it fills */
+void put_buffer(struct output *out, const void *buf, size_t nbytes)
+{
+	check_room(out, nbytes);
+	init_output(out);
+	if (out->digest != NULL) update_digest(out->digest, buf, nbytes);
+
+	size_t p = 0;
+	while (p < nbytes)
+	{
+		/* start a new slice unless the last one ends where this copy will go */
+		struct iovec *v = out->iov + out->iovcnt - 1;
+		if ((out->iovcnt == 0) || ((int8_t *)v->iov_base + v->iov_len != out->buf + out->len))
+		{
+			if (out->iovcnt == OUTPUT_IOV) flush_output(out);
+			v = out->iov + out->iovcnt++;
+			v->iov_base = out->buf + out->len;
+			v->iov_len = 0;
+		}
+
+		size_t ct = out->size - out->len;
+		if (ct > nbytes - p) ct = nbytes - p;
+		memcpy(out->buf + out->len, buf + p, ct);
+		v->iov_len += ct;
+		out->len += ct;
+		out->offset += ct;
+		p += ct;
+		if (out->len == out->size) flush_output(out);
+	}
+}
+
+/* append a buffer to the output without copying it (it must stay valid until flushed) */
+void put_mapped(struct output *out, const void *buf, size_t nbytes)
+{
+	/* O_DIRECT needs aligned buffers, so direct output is always copied */
+	if (out->direct)
+	{
+		put_buffer(out, buf, nbytes);
+		return;
+	}
+
+	check_room(out, nbytes);
+	init_output(out);
+	if (out->digest != NULL) update_digest(out->digest, buf, nbytes);
+	if (out->iovcnt == OUTPUT_IOV) flush_output(out);
+	out->iov[out->iovcnt].iov_base = (void *)buf;
+	out->iov[out->iovcnt++].iov_len = nbytes;
+	out->offset += nbytes;
+}
+
+/* append zero bytes to the output */
+void put_zero(struct output *out, size_t nbytes)
+{
+	static const int8_t zero[512];
+
+	while (nbytes > sizeof(zero))
+	{
+		put_buffer(out, zero, sizeof(zero));
+		nbytes -= sizeof(zero);
+	}
+	put_buffer(out, zero, nbytes);
+}
+
+/* append zero bytes to the output, skipping over whole blocks of them if the output is sparse */
+void put_hole(struct output *out, size_t nbytes)
+{
+	static const int8_t zero[SPARSE_BLOCK];
+
+	/* only space past the original end of file is known to read back as zeros */
+	off_t pos = out->base + out->offset;
+	size_t ct = (SPARSE_BLOCK - pos % SPARSE_BLOCK) % SPARSE_BLOCK;
+	if ((!out->sparse) || (pos < out->keep) || (ct + SPARSE_BLOCK > nbytes))
+	{
+		put_zero(out, nbytes);
+		return;
+	}
+
+	/* fill to a block boundary, then skip whole blocks, leaving the rest for the next write */
+	put_zero(out, ct);
+	nbytes -= ct;
+	flush_output(out);
+	size_t skip = nbytes - nbytes % SPARSE_BLOCK;
+	check_room(out, skip);
+	if (out->digest != NULL)
+	{
+		for (ct = 0; ct < skip; ct += SPARSE_BLOCK) update_digest(out->digest, zero, SPARSE_BLOCK);
+	}
+	out->offset += skip;
+	pos = out->base + out->offset;
+	if (out->positional)
+	{
+		/* parallel output: the file was already extended */
+		out->at = pos;
+	}
+	else
+	{
+		if ((pos > out->keep) && (pos > out->end) && (ftruncate(out->fd, pos) == -1)) err(1, "unable to extend output");
+		if (lseek(out->fd, pos, SEEK_SET) == -1) err(1, "unable to seek output");
+	}
+	put_zero(out, nbytes - skip);
+}
+
+/* stop before output goes past its limit (a file written in parallel that grew after the image was planned) */
+void check_room(struct output *out, size_t nbytes)
+{
+	if ((out->limit != -1) && (out->offset + (off_t)nbytes > out->limit)) errx(1, "%s grew after the image was planned", out->limit_name);
+}
+
+/* check whether a buffer is all zeros (memcmp is vectorized by the C library) */
+int is_zero(const void *buf, size_t nbytes)
+{
+	const int8_t *p = buf;
+
+	if (nbytes == 0) return 1;
+	if (p[0] != 0) return 0;
+	return (memcmp(p, p + 1, nbytes - 1) == 0);
+}
+
+/* append an 8-bit byte to the output */
+void put_int8(struct output *out, int8_t value)
+{
+	put_buffer(out, &value, 1);
+}
+
+/* append a 32-bit integer in little-endian format to the output */
+void put_int32(struct output *out, int value)
+{
+	int8_t buf[4];
+	int i;
 
 	for (i = 0; i < 4; i++)
 	{
-		int8_t byte_val = value & 0xff;
-		write_int8(fd, byte_val);
+		buf[i] = value & 0xff;
 		value >>= 8;
 	}
+	put_buffer(out, buf, 4);
+}
+
+/* write out everything waiting in the output buffer */
+void flush_output(struct output *out)
+{
+	struct iovec *iov = out->iov;
+	int iovcnt = out->iovcnt;
+
+	if (out->direct)
+	{
+		/* write only whole aligned blocks, keeping the remainder for next time */
+		size_t ct = out->len - out->len % DIRECT_ALIGN;
+		size_t p = 0;
+		while (p < ct)
+		{
+			ssize_t n = (out->positional) ? pwrite(out->fd, out->buf + p, ct - p, out->at) : write(out->fd, out->buf + p, ct - p);
+			if ((n == -1) && (errno == EINVAL) && (out->direct))
+			{
+				/* file system refused O_DIRECT after all */
+				set_direct(out, 0);
+				continue;
+			}
+			if (n == -1) err(1, NULL);
+			out->at += n;
+			p += n;
+		}
+		out->len -= ct;
+		memmove(out->buf, out->buf + ct, out->len);
+		out->iov[0].iov_base = out->buf;
+		out->iov[0].iov_len = out->len;
+		out->iovcnt = (out->len != 0) ? 1 : 0;
+		return;
+	}
+
+	while (iovcnt > 0)
+	{
+		ssize_t ct = (out->positional) ? pwritev(out->fd, iov, iovcnt, out->at) : writev(out->fd, iov, iovcnt);
+		if ((ct == -1) && (EXITING)) break;
+		if ((ct == -1) && (errno == EFAULT)) errx(1, "input file shrank while being written");
+		if (ct == -1) err(1, NULL);
+		out->at += ct;
+
+		/* skip past whatever was written, which may end part way through a slice */
+		while ((iovcnt > 0) && ((size_t)ct >= iov->iov_len))
+		{
+			ct -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (int8_t *)iov->iov_base + ct;
+			iov->iov_len -= ct;
+		}
+	}
+	out->iovcnt = 0;
+	out->len = 0;
+}
+
+/* add a record to the index */
+void index_record(struct index *ix, off_t offset, uint32_t size)
+{
+	if (ix->name == NULL) return;
+	if (!ix->open) index_start(ix, offset);
+
+	if ((ix->run_count != 0) && ((size != ix->run_size) || (ix->run_count == UINT32_MAX))) index_run(ix);
+	ix->run_size = size;
+	ix->run_count++;
+}
+
+/* add a mark to the index, ending the current tape file */
+void index_mark(struct index *ix, off_t offset, uint32_t mark)
+{
+	if (ix->name == NULL) return;
+	if (!ix->open) index_start(ix, offset);
+
+	if (ix->run_count != 0) index_run(ix);
+	index_int(ix, ix->entry + 8, offset, 8);
+	index_int(ix, ix->entry + 16, mark, 4);
+	index_int(ix, ix->entry + 20, ix->nruns, 4);
+	ix->open = 0;
+	if (mark == UINT32_MAX) ix->ended = 1;
+}
+
+/* start an index entry for a tape file */
+void index_start(struct index *ix, off_t offset)
+{
+	ix->entry = ix->len;
+	index_int(ix, ix->len, offset, 8);
+	index_int(ix, ix->len, 0, 8);
+	index_int(ix, ix->len, 0, 8);
+	ix->open = 1;
+	ix->nfiles++;
+	ix->nruns = 0;
+	ix->run_count = 0;
+}
+
+/* add the current run of same-size records to the open index entry */
+void index_run(struct index *ix)
+{
+	index_int(ix, ix->len, ix->run_size, 4);
+	index_int(ix, ix->len, ix->run_count, 4);
+	ix->nruns++;
+	ix->run_count = 0;
+}
+
+/* store a little-endian integer in the index (at the end, if pos == len) */
+void index_int(struct index *ix, size_t pos, uint64_t value, int nbytes)
+{
+	if (pos + nbytes > ix->size)
+	{
+		ix->size = (ix->size == 0) ? 65536 : ix->size * 2;
+		if ((ix->buf = realloc(ix->buf, ix->size)) == NULL) err(1, "unable to resize index");
+	}
+	if (pos + nbytes > ix->len) ix->len = pos + nbytes;
+	set_int(ix->buf + pos, value, nbytes);
+}
+
+/* store a little-endian integer */
+void set_int(uint8_t *buf, uint64_t value, int nbytes)
+{
+	while (nbytes-- > 0)
+	{
+		*buf++ = value & 0xff;
+		value >>= 8;
+	}
+}
+
+/* write the index file, once the image is complete */
+void write_index(struct index *ix, struct output *out)
+{
+	struct stat st;
+	uint8_t hdr[INDEX_HEADER];
+	int64_t sec = 0;
+	uint32_t nsec = 0;
+
+	if ((fstat(out->fd, &st) == 0) && (S_ISREG(st.st_mode)))
+	{
+		/* offsets are relative to the start of this run's output */
+		if (st.st_size != out->offset)
+		{
+			warnx("index not written: output did not start at the beginning of the file");
+			return;
+		}
+		sec = st.st_mtim.tv_sec;
+		nsec = st.st_mtim.tv_nsec;
+	}
+
+	/* unless the tape ended with an end-of-tape mark, the last tape file ends with the image */
+	if (!ix->ended)
+	{
+		if (!ix->open) index_start(ix, out->offset);
+		index_mark(ix, out->offset, 0);
+	}
+
+	set_int(hdr, 0x58495456, 4);	/* "VTIX" */
+	set_int(hdr + 4, INDEX_VERSION, 4);
+	set_int(hdr + 8, out->offset, 8);
+	set_int(hdr + 16, sec, 8);
+	set_int(hdr + 24, nsec, 4);
+	set_int(hdr + 28, ix->nfiles, 4);
+
+	int fd = open(ix->name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1) err(1, "error opening index file %s", ix->name);
+	write_buffer(fd, hdr, sizeof(hdr));
+	write_buffer(fd, ix->buf, ix->len);
+	if (close(fd) == -1) err(1, "error closing index file %s", ix->name);
+}
+
+/* open an existing image for output, positioned after its last record or mark */
+void append_output(struct output *out, const char *name)
+{
+	int fd = open(name, O_RDWR);
+	if (fd == -1) err(1, "error opening image %s", name);
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size == -1) err(1, "error seeking image %s", name);
+
+	/* drop end-of-tape marks */
+	off_t end = size;
+	while ((end >= 4) && (pread_int32(fd, end - 4, name) == UINT32_MAX)) end -= 4;
+
+	/* the trailing length word of the last record leads back to its leading length word */
+	if ((end & 1) != 0) errx(1, "%s: not a SIMH tape image", name);
+	if (end >= 4)
+	{
+		uint32_t sz = pread_int32(fd, end - 4, name);
+		if ((sz != 0) && ((sz & 0xF0000000) != 0xF0000000))
+		{
+			off_t start = end - 8 - sz - (sz & 1);
+			if ((start < 0) || (pread_int32(fd, start, name) != sz)) errx(1, "%s: image does not end with a complete record", name);
+		}
+	}
+
+	if ((end != size) && (ftruncate(fd, end) == -1)) err(1, "error truncating image %s", name);
+	if (lseek(fd, end, SEEK_SET) == -1) err(1, "error seeking image %s", name);
+	if (VERBOSE) fprintf(stderr, "append to %s at offset %lld%s\n", name, (long long)end, (end != size) ? " (end-of-tape mark removed)" : "");
+	out->fd = fd;
+}
+
+/* read a 32-bit little-endian integer from a given offset */
+uint32_t pread_int32(int fd, off_t offset, const char *name)
+{
+	uint8_t buf[4];
+
+	ssize_t ct = pread(fd, buf, 4, offset);
+	if (ct == -1) err(1, "error reading image %s", name);
+	if (ct != 4) errx(1, "%s: unexpected end of image", name);
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+/* find where output begins in a regular file (returns fcntl flags, or -1 if not a regular file) */
+int file_output(struct output *out)
+{
+	struct stat st;
+
+	if ((fstat(out->fd, &st) == -1) || (!S_ISREG(st.st_mode))) return -1;
+	int flags = fcntl(out->fd, F_GETFL);
+	if (flags == -1) return -1;
+	out->base = (flags & O_APPEND) ? st.st_size : lseek(out->fd, 0, SEEK_CUR);
+	if (out->base == -1) return -1;
+	out->keep = st.st_size;
+	return flags;
+}
+
+/* preallocate space for a regular-file output, and write it with O_DIRECT if possible */
+void direct_output(struct output *out, off_t size, int flags)
+{
+	/* appending writes at end of file, so growing the file first would leave a hole */
+	if ((size > 0) && ((flags & O_APPEND) == 0) && (out->base + size > out->keep))
+	{
+		if (posix_fallocate(out->fd, out->base, size) == 0) out->end = out->base + size;
+	}
+
+	/* O_DIRECT requires aligned file offsets as well as aligned buffers */
+	if ((out->base % DIRECT_ALIGN) != 0) return;
+	if (out->buf == NULL)
+	{
+		void *buf;
+		if (posix_memalign(&buf, DIRECT_ALIGN, out->size) != 0) err(1, "unable to initialize output buffer");
+		out->buf = buf;
+	}
+	set_direct(out, 1);
+}
+
+/* turn O_DIRECT on or off (where it exists) */
+void set_direct(struct output *out, int direct)
+{
+	out->direct = 0;
+#ifdef O_DIRECT
+	int flags = fcntl(out->fd, F_GETFL);
+	if (flags == -1) return;
+	flags = (direct) ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+	if (fcntl(out->fd, F_SETFL, flags) == -1) return;
+	out->direct = direct;
+#endif
+}
+
+/* on an exit after an error, write out records already accepted for output, as they would have been without buffering */
+void flush_at_exit(void)
+{
+	if ((EXITING) || (OUTPUT.iovcnt == 0)) return;
+	EXITING = 1;
+	if (OUTPUT.direct) set_direct(&OUTPUT, 0);
+	flush_output(&OUTPUT);
+}
+
+/* write out the end of the output, and release any preallocated space that wasn't needed */
+void finish_output(struct output *out)
+{
+	/* the last block may be partial, which O_DIRECT can't write */
+	if (out->direct)
+	{
+		flush_output(out);
+		set_direct(out, 0);
+	}
+	flush_output(out);
+
+	/* inputs may have shrunk since the image size was planned */
+	off_t end = out->base + out->offset;
+	if (end < out->keep) end = out->keep;
+	if ((out->end != 0) && (end < out->end))
+	{
+		if (ftruncate(out->fd, end) == -1) err(1, "unable to truncate output");
+	}
 }